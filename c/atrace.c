@@ -0,0 +1,110 @@
+#include "atrace.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#define ATRACE_BUFFER_EVENTS 1024
+
+struct atrace_buffer {
+  struct atrace_buffer *next;
+  uint32_t thread;
+  size_t count;
+  struct atrace_event events[ATRACE_BUFFER_EVENTS];
+};
+
+int atrace_active;
+
+static int atrace_fd = -1;
+static uint32_t atrace_threads;
+static struct atrace_buffer *atrace_buffers;		/* All buffers ever created, see atrace_close() */
+static __thread struct atrace_buffer *atrace_buffer;
+
+static void
+atrace_flush(struct atrace_buffer *buf) {
+  const char *p = (const char *)buf->events;
+  size_t len = buf->count * sizeof(struct atrace_event);
+  buf->count = 0;
+  // The file is opened with O_APPEND, a single write() of a whole buffer is not interleaved with other threads
+  while (len) {
+    ssize_t n = write(atrace_fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      DBG_LOG("Cannot write allocation trace: %s", strerror(errno));
+      return;
+    }
+    p += n;
+    len -= n;
+  }
+}
+
+static struct atrace_buffer *
+atrace_new_buffer(void) {
+  struct atrace_buffer *buf = XMALLOC(sizeof(*buf));
+  buf->thread = __atomic_fetch_add(&atrace_threads, 1, __ATOMIC_RELAXED);
+  buf->count = 0;
+  buf->next = __atomic_load_n(&atrace_buffers, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&atrace_buffers, &buf->next, buf, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  return buf;
+}
+
+void
+atrace_log(uint op, uint64_t size, uint64_t id) {
+  struct atrace_buffer *buf = atrace_buffer;
+  if (unlikely(!buf))
+    buf = atrace_buffer = atrace_new_buffer();
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  buf->events[buf->count++] = (struct atrace_event) {
+    .ts = ts.tv_sec * 1000000000ULL + ts.tv_nsec,
+    .thread = buf->thread,
+    .op = op,
+    .size = size,
+    .id = id };
+  if (buf->count == ATRACE_BUFFER_EVENTS)
+    atrace_flush(buf);
+}
+
+int
+atrace_open(const char *name) {
+  assert(atrace_fd < 0);
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666);
+  if (fd < 0)
+    return -1;
+  struct atrace_header hdr = {
+    .magic = ATRACE_MAGIC,
+    .version = ATRACE_VERSION,
+    .event_size = sizeof(struct atrace_event) };
+  if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  atrace_fd = fd;
+  __atomic_store_n(&atrace_active, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void
+atrace_close(void) {
+  if (atrace_fd < 0)
+    return;
+  __atomic_store_n(&atrace_active, 0, __ATOMIC_RELEASE);
+  for (struct atrace_buffer *buf = __atomic_load_n(&atrace_buffers, __ATOMIC_ACQUIRE); buf; buf = buf->next)
+    atrace_flush(buf);
+  close(atrace_fd);
+  atrace_fd = -1;
+}
+
+static void CONSTRUCTOR
+atrace_init(void) {
+  const char *name = getenv("ATRACE_FILE");
+  if (!name || !*name)
+    return;
+  if (atrace_open(name) < 0)
+    FATAL(255, "Cannot open allocation trace %s: %s", name, strerror(errno));
+  atexit(atrace_close);
+}
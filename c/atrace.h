@@ -0,0 +1,68 @@
+#pragma once
+
+#include "lib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Allocation trace recorder.
+ *
+ * Events are buffered per thread and appended to a binary file as fixed-size
+ * records (see struct atrace_event). The file starts with struct atrace_header.
+ * Recording is enabled either by atrace_open() or by setting the ATRACE_FILE
+ * environment variable before the program starts.
+ */
+
+#define ATRACE_MAGIC "ATRACE\0\1"
+#define ATRACE_VERSION 1
+
+enum atrace_op {
+  ATRACE_CACHE_ALLOC = 1,		/* rapidmem::cache::alloc(): size = chunk bytes, id = chunk */
+  ATRACE_CACHE_FREE,			/* rapidmem::cache::free(): size = chunk bytes, id = chunk */
+  ATRACE_MP_NEW,			/* mp_init()/mp_new(): size = chunk size, id = pool */
+  ATRACE_MP_DELETE,			/* mp_delete(): id = pool */
+  ATRACE_MP_ALLOC,			/* mp_alloc*(): size = requested bytes, id = pool */
+  ATRACE_MP_FLUSH,			/* mp_flush(): id = pool */
+  ATRACE_MP_SAVE,			/* mp_save()/mp_push(): size = state, id = pool */
+  ATRACE_MP_RESTORE,			/* mp_restore()/mp_pop(): size = state, id = pool */
+};
+
+struct atrace_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t event_size;
+};
+
+struct atrace_event {
+  uint64_t ts;				/* CLOCK_MONOTONIC in nanoseconds */
+  uint32_t thread;			/* Sequential number of the recording thread */
+  uint16_t op;				/* See enum atrace_op */
+  uint16_t reserved;
+  uint64_t size;
+  uint64_t id;
+};
+
+extern int atrace_active;
+
+/* Start recording to a file <name>. The file is truncated. Returns 0 on success, -1 on error (errno is set). */
+int atrace_open(const char *name);
+
+/* Flush buffers of all threads and stop recording. Threads must not record concurrently. */
+void atrace_close(void);
+
+/* For internal use only, do not call directly */
+void atrace_log(uint op, uint64_t size, uint64_t id);
+
+/* Record one event if the recording is active */
+static inline void
+atrace_record(uint op, uint64_t size, uint64_t id)
+{
+  if (unlikely(atrace_active))
+    atrace_log(op, size, id);
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,178 @@
+/* Allocation backends (see xalloc_set_backend()) on mempool workloads:
+ *
+ *   requests -- a window of short-lived pools, one per request, each
+ *               allocating small objects and a few big blocks
+ *   flush    -- one long-lived pool flushed after every request
+ *   grow     -- growing buffers of various sizes, mostly in the big chain
+ *
+ * Every workload runs with its own accounting tag. The bytes accounted to the
+ * tag are reported at the end of the workload before its pools are deleted,
+ * and once more after that as a check of the accounting.
+ *
+ * Before that, blocks of mixed odd sizes and allocations from pools created
+ * among them are checked to be aligned to __BIGGEST_ALIGNMENT__ bytes, with a
+ * nonzero exit status if they are not.
+ *
+ *	$ gcc -std=gnu11 -O2 -I.. -o backend backend.c ../mempool.c ../xalloc.c -lpthread
+ *	$ ./backend [requests [window [chunk KB]]]
+ */
+
+#include "mempool.h"
+
+#include <string.h>
+#include <time.h>
+
+static size_t requests = 200000, window = 64, chunk = 4 << 10;
+static size_t live_bytes;		/* Bytes accounted to the workload before its cleanup */
+
+static double
+now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned random_state = 1;
+
+static unsigned
+next_random(void) {
+  random_state = random_state * 1103515245 + 12345;
+  return random_state >> 8;
+}
+
+static void
+fill_pool(struct mempool *pool) {
+  uint n = 16 + next_random() % 256;
+  for (uint i = 0; i < n; i++) {
+    size_t size = next_random() % 8 ? 16 + next_random() % 112 : 1024 + next_random() % (4 * chunk);
+    char *p = mp_alloc_fast(pool, size);
+    p[0] = p[size - 1] = i;
+  }
+}
+
+static void
+run_requests(void) {
+  struct mempool **pools = XCALLOC(window * sizeof(*pools));
+  for (size_t i = 0; i < requests; i++) {
+    struct mempool **slot = &pools[i % window];
+    if (*slot)
+      mp_delete(*slot);
+    *slot = mp_new(chunk);
+    fill_pool(*slot);
+  }
+  live_bytes = xalloc_tag_bytes(xalloc_tag());
+  for (size_t i = 0; i < window; i++)
+    if (pools[i])
+      mp_delete(pools[i]);
+  XFREE(pools);
+}
+
+static void
+run_flush(void) {
+  struct mempool *pool = mp_new(chunk);
+  for (size_t i = 0; i < requests; i++) {
+    mp_flush(pool);
+    fill_pool(pool);
+  }
+  live_bytes = xalloc_tag_bytes(xalloc_tag());
+  mp_delete(pool);
+}
+
+static void
+run_grow(void) {
+  struct mempool *pool = mp_new(chunk);
+  for (size_t i = 0; i < requests / 16; i++) {
+    size_t size = 256 << (next_random() % 12);
+    char *p = mp_start(pool, 0);
+    for (size_t done = 0; done < size; done += 256) {
+      p = mp_spread(pool, p, 256);
+      memset(p, i, 256);
+      p += 256;
+    }
+    mp_end(pool, p);
+    if (i % 64 == 63)
+      mp_flush(pool);
+  }
+  live_bytes = xalloc_tag_bytes(xalloc_tag());
+  mp_delete(pool);
+}
+
+#define ALIGNED(p) !((uintptr_t)(p) % __BIGGEST_ALIGNMENT__)
+
+/* Returns the number of misaligned pointers */
+static uint
+check_alignment(void) {
+  void *blocks[256];
+  struct mempool *pools[16];
+  uint bad = 0;
+  for (uint i = 0; i < ARRAY_LEN(blocks); i++) {
+    blocks[i] = XMALLOC(1 + (size_t)next_random() % (i % 8 ? 200 : 20000));
+    bad += !ALIGNED(blocks[i]);
+    if (i % 16 == 15) {
+      struct mempool *pool = pools[i / 16] = mp_new(chunk);
+      for (uint j = 0; j < 64; j++)
+        bad += !ALIGNED(mp_alloc(pool, 1 + next_random() % 300));
+      bad += !ALIGNED(mp_start(pool, 1 + next_random() % 100));
+      bad += !ALIGNED(mp_grow(pool, 2 * chunk + 1));
+      mp_end(pool, (char *)mp_ptr(pool) + 1);
+    }
+  }
+  for (uint i = 0; i < ARRAY_LEN(blocks); i += 2) {
+    blocks[i] = XREALLOC(blocks[i], 1 + (size_t)next_random() % 1000);
+    bad += !ALIGNED(blocks[i]);
+  }
+  for (uint i = 0; i < ARRAY_LEN(blocks); i++)
+    XFREE(blocks[i]);
+  for (uint i = 0; i < ARRAY_LEN(pools); i++)
+    mp_delete(pools[i]);
+  return bad;
+}
+
+static const struct {
+  const char *name;
+  void (*run)(void);
+} workloads[] = {
+  { "requests", run_requests },
+  { "flush", run_flush },
+  { "grow", run_grow },
+};
+
+static int
+bench(const struct xalloc_backend *backend) {
+  xalloc_set_backend(backend);
+  random_state = 1;
+  uint bad = check_alignment();
+  if (bad) {
+    printf("%-8s %u misaligned pointers\n", backend->name, bad);
+    return 1;
+  }
+  for (uint w = 0; w < ARRAY_LEN(workloads); w++) {
+    uint tag = w + 1;
+    xalloc_name_tag(tag, workloads[w].name);
+    uint old_tag = xalloc_set_tag(tag);
+    random_state = 1;
+    double beg = now();
+    workloads[w].run();
+    double end = now();
+    xalloc_set_tag(old_tag);
+    printf("%-8s %-10s %8.3f s, %10zu bytes live, %zu leaked\n", backend->name, workloads[w].name, end - beg, live_bytes, xalloc_tag_bytes(tag));
+  }
+  return 0;
+}
+
+int
+main(int argc, char **argv) {
+  if (argc > 1)
+    requests = strtoull(argv[1], NULL, 0);
+  if (argc > 2)
+    window = strtoull(argv[2], NULL, 0);
+  if (argc > 3)
+    chunk = strtoull(argv[3], NULL, 0) << 10;
+  if (argc > 4 || !requests || !window || !chunk) {
+    fprintf(stderr, "Usage: backend [requests [window [chunk KB]]]\n");
+    return 1;
+  }
+  int err = bench(&xalloc_libc);
+  err |= bench(&xalloc_arena);
+  return err;
+}
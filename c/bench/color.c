@@ -0,0 +1,123 @@
+/* Cache coloring of small chunks (see mp_set_colors()): many pools are used
+ * round-robin, each allocating a few small objects near the start of its
+ * chunk before it is flushed, like per-connection pools serving short
+ * requests. The touched memory fits into the L1 cache, but when all chunks
+ * start at the same offset modulo the page, the pool structures and the first
+ * objects map to a few cache sets and evict each other. That is the case for
+ * the arena backend, which carves blocks of one size class one after another,
+ * so with classes above 16 KB (a multiple of the page size) the blocks and
+ * their headers repeat at the same offset in the page. Blocks of malloc() above
+ * its mmap threshold and arena blocks above XALLOC_ARENA_MAX are mapped one by
+ * one, so they share the offset as well.
+ *
+ * L1 data cache misses per operation are read from a perf_event_open()
+ * counter; where it is not available (e.g. in a VM or with
+ * kernel.perf_event_paranoid > 2) only the time is reported.
+ *
+ *	$ gcc -std=gnu11 -O2 -I.. -o color color.c ../mempool.c ../xalloc.c -lpthread
+ *	$ ./color [pools [chunk KB [colors]]]
+ */
+
+#include "mempool.h"
+
+#include <string.h>
+#include <time.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+static size_t pools = 128, chunk = 64 << 10, rounds = 64 << 20;
+static uint colors = 64;
+
+#define OBJECTS 4			/* Objects allocated by a pool before it is flushed */
+#define OBJECT_SIZE 48
+
+static double
+now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Returns -1 if the counter is not available */
+static int
+counter_open(void) {
+  struct perf_event_attr attr;
+  bzero(&attr, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t
+counter_read(int fd) {
+  uint64_t value = 0;
+  if (read(fd, &value, sizeof(value)) != sizeof(value))
+    value = 0;
+  return value;
+}
+
+static void
+bench(const struct xalloc_backend *backend, uint use_colors) {
+  xalloc_set_backend(backend);
+  mp_set_colors(use_colors);
+  struct mempool **p = XMALLOC(pools * sizeof(*p));
+  for (size_t i = 0; i < pools; i++)
+    p[i] = mp_new(chunk);
+
+  int fd = counter_open();
+  uint64_t misses = 0;
+  double beg = now();
+  if (fd >= 0)
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  for (size_t r = 0; r < rounds / pools; r++)
+    for (size_t i = 0; i < pools; i++) {
+      struct mempool *pool = p[i];
+      if (r % OBJECTS == 0)
+        mp_flush(pool);
+      uint *o = mp_alloc_fast(pool, OBJECT_SIZE);
+      o[0] = r;
+      o[OBJECT_SIZE / sizeof(*o) - 1] = i;
+    }
+  if (fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    misses = counter_read(fd);
+    close(fd);
+  }
+  double end = now();
+
+  size_t ops = rounds / pools * pools;
+  printf("%-8s %3u colors %8.2f ns/op", backend->name, use_colors, (end - beg) * 1e9 / ops);
+  if (fd >= 0)
+    printf("  %6.3f L1 misses/op", (double)misses / ops);
+  else
+    printf("  L1 misses n/a");
+  printf("\n");
+
+  for (size_t i = 0; i < pools; i++)
+    mp_delete(p[i]);
+  XFREE(p);
+}
+
+int
+main(int argc, char **argv) {
+  if (argc > 1)
+    pools = strtoull(argv[1], NULL, 0);
+  if (argc > 2)
+    chunk = strtoull(argv[2], NULL, 0) << 10;
+  if (argc > 3)
+    colors = strtoul(argv[3], NULL, 0);
+  if (argc > 4 || !pools || !chunk) {
+    fprintf(stderr, "Usage: color [pools [chunk KB [colors]]]\n");
+    return 1;
+  }
+  bench(&xalloc_libc, 0);
+  bench(&xalloc_libc, colors);
+  bench(&xalloc_arena, 0);
+  bench(&xalloc_arena, colors);
+  return 0;
+}
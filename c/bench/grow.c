@@ -0,0 +1,110 @@
+/* Build one big buffer by appending blocks to a mempool growing buffer,
+ * compared with doubling by realloc() and by malloc() + memcpy(). Apart from
+ * the total time, which is dominated by page faults, the time spent growing
+ * the buffer is reported.
+ *
+ *	$ gcc -std=gnu11 -O2 -I.. -o grow grow.c ../mempool.c ../xalloc.c -lpthread
+ *	$ ./grow [MB [block KB]]
+ */
+
+#include "mempool.h"
+
+#include <string.h>
+#include <time.h>
+
+static size_t total = 1024 << 20, block = 64 << 10;
+
+static double
+now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+report(const char *name, double beg, double grow, unsigned moves, const char *buf) {
+  double secs = now() - beg;
+  printf("%-16s %8.3f s %8.1f MB/s  growing %8.3f s %4u moves (check %d)\n", name, secs, total / secs / (1 << 20), grow, moves, buf[total - 1]);
+}
+
+static void
+bench_mempool(void) {
+  struct mempool *pool = mp_new(64 << 10);
+  double beg = now();
+  double grow = 0;
+  unsigned moves = 0;
+  char *buf = mp_start(pool, block), *old = buf;
+  for (size_t len = 0; len < total; len += block) {
+    if (len + block > mp_avail(pool)) {
+      double t = now();
+      buf = mp_grow(pool, len + block);
+      grow += now() - t;
+      moves += buf != old;
+      old = buf;
+    }
+    memset(buf + len, len / block, block);
+  }
+  mp_end(pool, buf + total);
+  report("mp_grow", beg, grow, moves, buf);
+  mp_delete(pool);
+}
+
+static void
+bench_realloc(void) {
+  double beg = now(), grow = 0;
+  unsigned moves = 0;
+  size_t cap = block;
+  char *buf = malloc(cap), *old = buf;
+  for (size_t len = 0; len < total; len += block) {
+    if (len + block > cap) {
+      double t = now();
+      cap *= 2;
+      buf = realloc(buf, cap);
+      grow += now() - t;
+      moves += buf != old;
+      old = buf;
+    }
+    memset(buf + len, len / block, block);
+  }
+  report("realloc", beg, grow, moves, buf);
+  free(buf);
+}
+
+static void
+bench_copy(void) {
+  double beg = now(), grow = 0;
+  unsigned moves = 0;
+  size_t cap = block;
+  char *buf = malloc(cap);
+  for (size_t len = 0; len < total; len += block) {
+    if (len + block > cap) {
+      double t = now();
+      char *p = malloc(cap * 2);
+      memcpy(p, buf, len);
+      free(buf);
+      grow += now() - t;
+      buf = p;
+      cap *= 2;
+      moves++;
+    }
+    memset(buf + len, len / block, block);
+  }
+  report("malloc + memcpy", beg, grow, moves, buf);
+  free(buf);
+}
+
+int
+main(int argc, char **argv) {
+  if (argc > 1)
+    total = strtoull(argv[1], NULL, 0) << 20;
+  if (argc > 2)
+    block = strtoull(argv[2], NULL, 0) << 10;
+  if (argc > 3 || !block || !total || total % block) {
+    fprintf(stderr, "Usage: grow [MB [block KB]]\n");
+    return 1;
+  }
+  bench_mempool();
+  bench_realloc();
+  bench_copy();
+  return 0;
+}
@@ -0,0 +1,166 @@
+/* Append-heavy workloads: mp_vector and the C macros compared with std::vector.
+ *
+ *	$ gcc -std=gnu11 -O2 -c ../mempool.c ../xalloc.c
+ *	$ g++ -std=gnu++14 -O2 -I.. -o vector vector.cpp mempool.o xalloc.o -lpthread
+ *	$ ./vector [small arrays [big array MB]]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "mempool-vector.h"
+
+namespace {
+
+const size_t batch = 1000;	// Arrays kept alive together
+size_t small_arrays = 1000000;
+size_t big_elems = (512 << 20) / sizeof(int);
+
+std::vector<unsigned> lengths;
+
+double
+now()
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void
+report(const char *workload, const char *name, double beg, unsigned long long check)
+{
+  printf("%-7s %-12s %8.3f s (check %llu)\n", workload, name, now() - beg, check);
+}
+
+/* Many short arrays of random length, built in batches and dropped together */
+void
+small_std()
+{
+  double beg = now();
+  unsigned long long check = 0;
+  std::vector<std::vector<int>> arrays(batch);
+  for (size_t i = 0; i < small_arrays; i++)
+    {
+      std::vector<int> &a = arrays[i % batch];
+      a = std::vector<int>();
+      for (unsigned j = 0; j < lengths[i]; j++)
+	a.push_back(j);
+      check += a.size();
+    }
+  report("small", "std::vector", beg, check);
+}
+
+void
+small_mp_vector()
+{
+  double beg = now();
+  unsigned long long check = 0;
+  struct mempool *pool = mp_new(64 << 10);
+  std::unique_ptr<int *[]> arrays(new int *[batch]);
+  for (size_t i = 0; i < small_arrays; i++)
+    {
+      if (i % batch == 0)
+	mp_flush(pool);
+      mp_vector<int> a(pool);
+      for (unsigned j = 0; j < lengths[i]; j++)
+	a.push_back(j);
+      check += a.size();
+      arrays[i % batch] = a.finish();
+    }
+  mp_delete(pool);
+  report("small", "mp_vector", beg, check);
+}
+
+void
+small_macros()
+{
+  double beg = now();
+  unsigned long long check = 0;
+  struct mempool *pool = mp_new(64 << 10);
+  std::unique_ptr<int *[]> arrays(new int *[batch]);
+  for (size_t i = 0; i < small_arrays; i++)
+    {
+      if (i % batch == 0)
+	mp_flush(pool);
+      MP_VECTOR(int) a;
+      mp_vec_start(&a, pool, 0);
+      for (unsigned j = 0; j < lengths[i]; j++)
+	*mp_vec_push(&a) = j;
+      check += a.len;
+      arrays[i % batch] = mp_vec_end(&a);
+    }
+  mp_delete(pool);
+  report("small", "mp_vec_push", beg, check);
+}
+
+/* One big array */
+void
+big_std()
+{
+  double beg = now();
+  std::vector<int> a;
+  for (size_t i = 0; i < big_elems; i++)
+    a.push_back(i);
+  report("big", "std::vector", beg, a.size() + a.back());
+}
+
+void
+big_mp_vector()
+{
+  double beg = now();
+  struct mempool *pool = mp_new(64 << 10);
+  mp_vector<int> a(pool);
+  for (size_t i = 0; i < big_elems; i++)
+    a.push_back(i);
+  unsigned long long check = a.size() + a.back();
+  a.finish();
+  mp_delete(pool);
+  report("big", "mp_vector", beg, check);
+}
+
+void
+big_macros()
+{
+  double beg = now();
+  struct mempool *pool = mp_new(64 << 10);
+  MP_VECTOR(int) a;
+  mp_vec_start(&a, pool, 0);
+  for (size_t i = 0; i < big_elems; i++)
+    *mp_vec_push(&a) = i;
+  unsigned long long check = a.len + a.ptr[a.len - 1];
+  mp_vec_end(&a);
+  mp_delete(pool);
+  report("big", "mp_vec_push", beg, check);
+}
+
+} /* anonymous namespace */
+
+int
+main(int argc, char **argv)
+{
+  if (argc > 1)
+    small_arrays = strtoull(argv[1], NULL, 0);
+  if (argc > 2)
+    big_elems = (strtoull(argv[2], NULL, 0) << 20) / sizeof(int);
+  if (argc > 3 || !big_elems)
+    {
+      fprintf(stderr, "Usage: vector [small arrays [big array MB]]\n");
+      return 1;
+    }
+
+  std::default_random_engine rand(1);
+  std::geometric_distribution<unsigned> dist(1.0 / 32);
+  lengths.resize(small_arrays);
+  for (unsigned &len : lengths)
+    len = dist(rand);
+
+  small_std();
+  small_mp_vector();
+  small_macros();
+  big_std();
+  big_mp_vector();
+  big_macros();
+  return 0;
+}
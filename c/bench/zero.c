@@ -0,0 +1,103 @@
+/* Zeroed allocations: mp_alloc_zero() compared with mp_alloc() + bzero().
+ * The first round runs on fresh chunks, the next ones on chunks recycled by
+ * mp_flush(). Every object is written sparsely, like a zeroed hash table.
+ * Reading a page of a fresh mapping before writing it costs one more page
+ * fault, which can outweigh the saved bzero(), so the benchmark only writes.
+ * Zeroing of blocks grown by mp_realloc_zero() is checked first.
+ *
+ *	$ gcc -std=gnu11 -O2 -I.. -o zero zero.c ../mempool.c ../xalloc.c -lpthread
+ *	$ ./zero [MB per round [object KB [chunk KB]]]
+ */
+
+#include "mempool.h"
+
+#include <string.h>
+#include <time.h>
+
+static size_t total = 1024 << 20, object = 16 << 10, chunk = 1 << 20;
+
+static double
+now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned
+round_zero(struct mempool *pool, int use_bzero) {
+  unsigned check = 0;
+  for (size_t done = 0; done < total; done += object) {
+    unsigned *p;
+    if (use_bzero) {
+      p = mp_alloc(pool, object);
+      bzero(p, object);
+    } else
+      p = mp_alloc_zero(pool, object);
+    for (size_t i = 0; i < object / sizeof(*p); i += 1024)
+      p[i] = done;
+    check += p[1];
+  }
+  return check;
+}
+
+/* Blocks grown by mp_realloc_zero() have to be zero behind the old data: a
+ * mapping grown by mremap() contains the old chunk tail there */
+static int
+check_grow(void) {
+  static const size_t sizes[][2] = {
+    { 2 << 20, 8 << 20 },		/* Mapping grown by mremap() */
+    { 64 << 10, 4 << 20 },		/* Malloc()ed chunk moved to a mapping */
+    { 100, 2 << 20 },			/* Small chunk moved to the big chain */
+    { 100, 3000 },
+  };
+  int errors = 0;
+  struct mempool *pool = mp_new(chunk);
+  for (uint i = 0; i < ARRAY_LEN(sizes); i++) {
+    size_t old_size = sizes[i][0], size = sizes[i][1];
+    for (int round = 0; round < 2; round++) {	/* The second round gets dirty chunks */
+      unsigned char *p = mp_alloc_zero(pool, old_size);
+      memset(p, 0xff, old_size);
+      p = mp_realloc_zero(pool, p, size);
+      for (size_t k = old_size; k < size; k++)
+        if (p[k]) {
+          fprintf(stderr, "mp_realloc_zero(%zu -> %zu): byte %zu is not zero\n", old_size, size, k);
+          errors++;
+          break;
+        }
+      mp_flush(pool);
+    }
+  }
+  mp_delete(pool);
+  return errors;
+}
+
+static void
+bench(const char *name, int use_bzero) {
+  struct mempool *pool = mp_new(chunk);
+  for (int round = 0; round < 3; round++) {
+    double beg = now();
+    unsigned check = round_zero(pool, use_bzero);
+    printf("%-20s %-8s %8.3f s (check %u)\n", name, round ? "recycled" : "fresh", now() - beg, check);
+    mp_flush(pool);
+  }
+  mp_delete(pool);
+}
+
+int
+main(int argc, char **argv) {
+  if (argc > 1)
+    total = strtoull(argv[1], NULL, 0) << 20;
+  if (argc > 2)
+    object = strtoull(argv[2], NULL, 0) << 10;
+  if (argc > 3)
+    chunk = strtoull(argv[3], NULL, 0) << 10;
+  if (argc > 4 || !total || !object || !chunk) {
+    fprintf(stderr, "Usage: zero [MB per round [object KB [chunk KB]]]\n");
+    return 1;
+  }
+  if (check_grow())
+    return 1;
+  bench("mp_alloc + bzero", 1);
+  bench("mp_alloc_zero", 0);
+  return 0;
+}
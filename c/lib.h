@@ -64,8 +64,66 @@
 #define SENTINEL_CHECK __attribute__((sentinel))			/** The last argument must be NULL **/
 #define ARRAY_LEN(ARR) (sizeof(ARR)/sizeof(*(ARR)))
 
+/*** === Allocation ***/
+
+/*
+ * All memory of the library is allocated by XMALLOC() & co. through a backend
+ * which can be switched at runtime by xalloc_set_backend(). Every block is
+ * accounted to the tag of the allocating thread (see xalloc_set_tag()), so the
+ * memory can be attributed to subsystems. Implemented in xalloc.c.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Allocation backend. Freed and reallocated blocks are passed with their sizes. */
+struct xalloc_backend {
+  const char *name;
+  void *(*malloc)(size_t size);
+  void *(*calloc)(size_t size);
+  void *(*realloc)(void *ptr, size_t old_size, size_t size);
+  void (*free)(void *ptr, size_t size);
+};
+
+extern const struct xalloc_backend xalloc_libc;		/* malloc() & co., the default */
+extern const struct xalloc_backend xalloc_arena;	/* Size classes carved from big mmap()ed regions */
+
+/* Use <backend> for new blocks. Blocks allocated before are still freed by their backend. At most 8 backends can be used. */
+void xalloc_set_backend(const struct xalloc_backend *backend);
+
+#define XALLOC_TAGS 64
+
+/* Set the accounting tag (< XALLOC_TAGS) of the calling thread and return the previous one. The default tag is 0. */
+uint xalloc_set_tag(uint tag);
+void xalloc_name_tag(uint tag, const char *name);
+/* Number of bytes allocated with <tag> and not freed yet */
+size_t xalloc_tag_bytes(uint tag);
+/* Print non-empty tags */
+void xalloc_dump(FILE *f);
+
+/* Let the next <n> allocations succeed and fail all allocations after them, for testing. Negative <n> stops failing. */
+void xalloc_fail_after(long n);
+
+/* For memory not obtained by xalloc_malloc() & co., e.g. mapped by the caller: returns 0 if the allocation has to fail (see xalloc_fail_after()) */
+int xalloc_may_alloc(void);
+/* Account <delta> bytes to <tag> */
+void xalloc_account(uint tag, ssize_t delta);
+/* Current tag of the calling thread */
+uint xalloc_tag(void);
+
+/* Return NULL on failure */
+void *xalloc_malloc(size_t size);
+void *xalloc_calloc(size_t size);
+void *xalloc_realloc(void *ptr, size_t size);
+void xalloc_free(void *ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
 #define XMALLOC(size) ({                                           \
-    void *$p = malloc((size));                                     \
+    void *$p = xalloc_malloc((size));                              \
     if (!$p)                                                       \
         FATAL(255, "Cannot allocate %zu bytes of memory", (size)); \
                                                                    \
@@ -73,18 +131,25 @@
 })
 
 #define XMALLOC_ZERO(size) ({    \
-    void *$p = XMALLOC((size));  \
-    bzero($p, size);             \
+    void *$p = XCALLOC((size));  \
                                  \
     $p;                          \
 })
 
+#define XCALLOC(size) ({                                           \
+    void *$p = xalloc_calloc((size));                              \
+    if (!$p)                                                       \
+        FATAL(255, "Cannot allocate %zu bytes of memory", (size)); \
+                                                                   \
+    $p;                                                            \
+})
+
 #define XREALLOC(ptr, size) ({                                      \
-    void *$p = realloc(ptr, (size));                                \
+    void *$p = xalloc_realloc(ptr, (size));                         \
     if ((size) > 0 && !$p)                                          \
         FATAL(255, "Cannot reallocate %zu bytes of memory", (size));\
                                                                     \
     $p;                                                             \
 })
 
-#define XFREE(ptr) free(ptr)
+#define XFREE(ptr) xalloc_free(ptr)
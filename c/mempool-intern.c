@@ -0,0 +1,130 @@
+#include "mempool.h"
+
+#include <string.h>
+
+/* Open addressing with linear probing. Every slot caches the hash of its
+ * string, so probing compares the strings only when the hashes match.
+ *
+ * The saved states of the pool record the table and the number of strings
+ * interned before them. Every slot records the order of its string, so after
+ * mp_restore() the strings interned later (they are freed) are recognized
+ * and removed from the table. */
+
+struct mp_intern_slot {
+  const char *str;			/* NULL for an empty slot */
+  uint32_t hash;
+  uint32_t len;
+  size_t order;				/* Number of strings interned before this one */
+};
+
+struct mp_intern_table {
+  size_t mask;				/* Number of slots - 1 */
+  size_t count;				/* Used slots, can be more than pool->state.interned after mp_restore() */
+  struct mp_intern_slot slots[];
+};
+
+#define MP_INTERN_MIN_SLOTS 64
+
+static uint32_t
+mp_intern_hash(const char *s, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)s[i]) * 0x100000001b3ULL;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static struct mp_intern_table *
+mp_intern_new_table(struct mempool *pool, size_t slots) {
+  struct mp_intern_table *t = mp_alloc(pool, sizeof(*t) + slots * sizeof(t->slots[0]));
+  t->mask = slots - 1;
+  t->count = 0;
+  bzero(t->slots, slots * sizeof(t->slots[0]));
+  return t;
+}
+
+/* The first empty slot for <hash>, the strings in the way are not compared */
+static struct mp_intern_slot *
+mp_intern_find_empty(struct mp_intern_table *t, uint32_t hash) {
+  size_t i = hash & t->mask;
+  while (t->slots[i].str)
+    i = (i + 1) & t->mask;
+  return &t->slots[i];
+}
+
+static struct mp_intern_slot *
+mp_intern_find(struct mp_intern_table *t, const char *s, size_t len, uint32_t hash) {
+  for (size_t i = hash & t->mask; ; i = (i + 1) & t->mask) {
+    struct mp_intern_slot *slot = &t->slots[i];
+    if (!slot->str || (slot->hash == hash && slot->len == len && !memcmp(slot->str, s, len)))
+      return slot;
+  }
+}
+
+/* The old table stays in the pool until it is flushed, saved states can refer to it */
+static void
+mp_intern_grow(struct mempool *pool) {
+  struct mp_intern_table *old = pool->state.intern;
+  struct mp_intern_table *t = mp_intern_new_table(pool, old ? 2 * (old->mask + 1) : MP_INTERN_MIN_SLOTS);
+  if (old)
+    for (size_t i = 0; i <= old->mask; i++) {
+      struct mp_intern_slot *slot = &old->slots[i];
+      if (slot->str)
+        *mp_intern_find_empty(t, slot->hash) = *slot;
+    }
+  t->count = old ? old->count : 0;
+  pool->state.intern = t;
+}
+
+/* Remove the strings interned after the state restored last. Every slot is taken
+ * out and put back unless it is removed, starting after an empty slot, so that
+ * every cluster of slots is rebuilt from its beginning. The removed strings are
+ * freed, so they are never compared. */
+static void
+mp_intern_trim(struct mempool *pool) {
+  struct mp_intern_table *t = pool->state.intern;
+  size_t keep = pool->state.interned;
+  size_t start = 0;
+  while (t->slots[start].str)
+    start++;
+  for (size_t n = 1; n <= t->mask + 1; n++) {
+    struct mp_intern_slot *slot = &t->slots[(start + n) & t->mask];
+    if (!slot->str)
+      continue;
+    struct mp_intern_slot s = *slot;
+    slot->str = NULL;
+    if (s.order < keep)
+      *mp_intern_find_empty(t, s.hash) = s;
+  }
+  t->count = keep;
+}
+
+const char *
+mp_intern(struct mempool *pool, const char *s, size_t len) {
+  if (unlikely(len > UINT32_MAX))
+    FATAL(255, "Cannot intern a string of %zu bytes", len);
+  uint32_t hash = mp_intern_hash(s, len);
+  struct mp_intern_table *t = pool->state.intern;
+  if (unlikely(t && t->count != pool->state.interned))
+    mp_intern_trim(pool);
+  if (unlikely(!t || 4 * (t->count + 1) > 3 * (t->mask + 1))) {
+    mp_intern_grow(pool);
+    t = pool->state.intern;
+  }
+  struct mp_intern_slot *slot = mp_intern_find(t, s, len, hash);
+  if (!slot->str) {
+    char *str = mp_alloc_noalign(pool, len + 1);
+    memcpy(str, s, len);
+    str[len] = 0;
+    *slot = (struct mp_intern_slot) { .str = str, .hash = hash, .len = len, .order = pool->state.interned++ };
+    t->count++;
+  }
+  return slot->str;
+}
+
+const char *
+mp_intern_str(struct mempool *pool, const char *s) {
+  return mp_intern(pool, s, strlen(s));
+}
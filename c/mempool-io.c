@@ -0,0 +1,196 @@
+#include "mempool.h"
+
+#include <errno.h>
+#include <string.h>
+
+/* Reads start with MP_READ_MIN bytes and double while they fill the buffer */
+#define MP_READ_MIN 4096
+#define MP_READ_MAX (1 << 20)
+
+/* read() restarted after signals, returns the number of bytes or -1 */
+static ssize_t
+mp_read_some(int fd, void *buf, size_t size) {
+  ssize_t n;
+  do
+    n = read(fd, buf, size);
+  while (n < 0 && errno == EINTR);
+  return n;
+}
+
+void *
+mp_read_fd(struct mempool *pool, int fd, size_t *len) {
+  struct stat st;
+  size_t want = MP_READ_MIN;
+  // One more byte than the rest of a regular file, so that its end is found without growing the buffer
+  if (!fstat(fd, &st) && S_ISREG(st.st_mode)) {
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos >= 0 && st.st_size > pos)
+      want = st.st_size - pos + 1;
+  }
+  char *p = mp_start(pool, want + 1);
+  size_t n = 0;
+  for (;;) {
+    if (n + 1 >= mp_avail(pool))
+      p = mp_grow(pool, n + want + 1);
+    size_t space = mp_avail(pool) - n - 1;
+    ssize_t r = mp_read_some(fd, p + n, space);
+    if (r < 0) {
+      int err = errno;
+      mp_end(pool, p);
+      errno = err;
+      return NULL;
+    }
+    if (!r)
+      break;
+    n += r;
+    if ((size_t)r == space)
+      want = MIN(want * 2, (size_t)MP_READ_MAX);
+  }
+  p[n] = 0;
+  mp_end(pool, p + n + 1);
+  if (len)
+    *len = n;
+  return p;
+}
+
+void *
+mp_read_file(struct mempool *pool, const char *name, size_t *len) {
+  int fd = open(name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  void *p = mp_read_fd(pool, fd, len);
+  int err = errno;
+  close(fd);
+  errno = err;
+  return p;
+}
+
+void
+mp_reader_init(struct mp_reader *r, struct mempool *pool, int fd) {
+  *r = (struct mp_reader) {
+    .pool = pool,
+    .fd = fd,
+    .want = MP_READ_MIN,
+  };
+}
+
+/* The block of the reader can be reopened if nothing has been allocated after it */
+static int
+mp_reader_last(struct mp_reader *r) {
+  struct mempool *pool = r->pool;
+  if (!r->data || r->keep)
+    return 0;
+  if (r->big)
+    return r->data == pool->last_big;
+  return r->data + r->len + 1 == (char *)pool->state.last[0] - pool->state.free[0];
+}
+
+/* Read more data after the unparsed rest of the block. Returns the number of bytes read, 0 at the end of input or -1. */
+static ssize_t
+mp_reader_fill(struct mp_reader *r) {
+  struct mempool *pool = r->pool;
+  size_t tail = r->len - r->pos;
+  char *src = r->data + r->pos, *p;
+  if (mp_reader_last(r)) {
+    mp_open_fast(pool, r->data);
+    if (!r->pos)
+      p = r->data;
+    else if (!pool->idx) {
+      // Lines returned so far stay in place, the new block starts right after them with the rest
+      mp_end(pool, src);
+      p = mp_start_noalign(pool, 0);
+    } else {
+      mp_end(pool, src);
+      p = mp_start_noalign(pool, tail + r->want + 1);
+      memcpy(p, src, tail);
+    }
+  } else {
+    p = mp_start_noalign(pool, tail + r->want + 1);
+    if (tail)
+      memcpy(p, src, tail);
+  }
+  p = mp_grow(pool, tail + r->want + 1);	// Keeps the rest at the start of the buffer
+
+  size_t space = mp_avail(pool) - tail - 1;
+  ssize_t n = mp_read_some(r->fd, p + tail, space);
+  if (n < 0) {
+    r->error = errno;
+    n = 0;
+  }
+  if ((size_t)n == space)
+    r->want = MIN(r->want * 2, (size_t)MP_READ_MAX);
+  r->data = p;
+  r->big = pool->idx;
+  r->keep = 0;
+  r->pos = 0;
+  r->len = tail + n;
+  p[r->len] = 0;
+  mp_end(pool, p + r->len + 1);
+  return r->error ? -1 : n;
+}
+
+char *
+mp_getdelim(struct mp_reader *r, size_t *len, int delim) {
+  for (;;) {
+    if (r->data) {
+      char *line = r->data + r->pos;
+      char *end = memchr(line + r->scan, delim, r->len - r->pos - r->scan);
+      if (end) {
+        *end = 0;
+        r->pos = end + 1 - r->data;
+        r->scan = 0;
+        if (len)
+          *len = end - line;
+        return line;
+      }
+      r->scan = r->len - r->pos;
+    }
+    if (r->eof || r->error)
+      break;
+    ssize_t n = mp_reader_fill(r);
+    if (n <= 0) {
+      r->eof = !n;
+      break;
+    }
+  }
+  // The last line without a delimiter is terminated by the zero byte after the block
+  if (r->data && r->pos < r->len && !r->error) {
+    char *line = r->data + r->pos;
+    if (len)
+      *len = r->len - r->pos;
+    r->pos = r->len;
+    r->scan = 0;
+    return line;
+  }
+  return NULL;
+}
+
+char *
+mp_getline(struct mp_reader *r, size_t *len) {
+  return mp_getdelim(r, len, '\n');
+}
+
+void
+mp_reader_restore(struct mp_reader *r, struct mempool_state *state) {
+  size_t tail = r->data ? r->len - r->pos : 0;
+  char *src = r->data + r->pos, *copy = NULL;
+  // Freed big chunks can be unmapped, small ones stay in the pool until they are reused below
+  if (tail && r->big) {
+    copy = XMALLOC(tail);
+    memcpy(copy, src, tail);
+    src = copy;
+  }
+  mp_restore(r->pool, state);
+  r->data = NULL;
+  r->pos = r->len = r->scan = 0;
+  if (tail) {
+    char *p = mp_start_noalign(r->pool, tail + 1);
+    memmove(p, src, tail);
+    p[tail] = 0;
+    r->data = mp_end(r->pool, p + tail + 1);
+    r->big = r->pool->idx;
+    r->keep = 1;
+    r->len = tail;
+  }
+  XFREE(copy);
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+/* Typed growable arrays built on the growing buffer of a mempool.
+ *
+ * An array is the growing buffer of its pool (see mp_start()), so no other
+ * allocation from the pool can be made until the array is closed by
+ * mp_vec_end(). While the array fits in the chunks of the pool it grows in
+ * place or moves to a fresh chunk once; above the threshold of the pool it
+ * lives in the big chain and grows by doubling with realloc() or mremap().
+ * mp_vec_end() shrinks an array in the big chain to its size.
+ *
+ *   MP_VECTOR(int) v;
+ *   mp_vec_start(&v, pool, 16);
+ *   for (int i = 0; i < n; i++)
+ *     *mp_vec_push(&v) = i;
+ *   int *a = mp_vec_end(&v);      // v.len elements
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include "mempool.h"
+#ifdef __cplusplus
+}
+#endif
+
+/* Type of an array of <type> */
+#define MP_VECTOR(type) struct { struct mempool *pool; type *ptr; size_t len; }
+
+/* Open an empty array with room for <n> elements on <pool> */
+#define mp_vec_start(v, p, n) ((v)->pool = (p), (v)->len = 0, (v)->ptr = (typeof((v)->ptr)) mp_start((v)->pool, (n) * sizeof(*(v)->ptr)))
+
+/* Number of elements the array can hold without moving */
+#define mp_vec_capacity(v) (mp_avail((v)->pool) / sizeof(*(v)->ptr))
+
+/* Make room for at least <n> elements, the array may move */
+#define mp_vec_reserve(v, n) ((v)->ptr = (typeof((v)->ptr)) mp_grow((v)->pool, (n) * sizeof(*(v)->ptr)))
+
+/* Append <n> uninitialized elements and return a pointer to the first one */
+#define mp_vec_extend(v, n) ({								\
+    typeof(v) _v = (v);									\
+    size_t _n = (n);									\
+    if (_v->len + _n > mp_vec_capacity(_v))						\
+      _v->ptr = (typeof(_v->ptr)) mp_grow_internal(_v->pool, (_v->len + _n) * sizeof(*_v->ptr));	\
+    _v->len += _n;									\
+    _v->ptr + _v->len - _n;								\
+})
+
+/* Append one uninitialized element and return a pointer to it: *mp_vec_push(&v) = x; */
+#define mp_vec_push(v) mp_vec_extend(v, 1)
+
+/* Close the array and return a pointer to its <len> elements (see mp_end_fit()) */
+#define mp_vec_end(v) ((typeof((v)->ptr)) mp_end_fit((v)->pool, (v)->ptr + (v)->len))
+
+#ifdef __cplusplus
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/* The same for C++. Elements are moved by memcpy(), so they have to be trivially copyable. */
+template <typename T>
+class mp_vector
+{
+  static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable types supported");
+  static_assert(alignof(T) <= __BIGGEST_ALIGNMENT__, "Mempools do not align to more than __BIGGEST_ALIGNMENT__");
+
+  struct mempool *pool_;
+  T *ptr_;
+  size_t len_;
+
+  void grow(size_t n)
+  {
+    ptr_ = static_cast<T *>(mp_grow_internal(pool_, n * sizeof(T)));
+  }
+
+public:
+  typedef T value_type;
+  typedef T *iterator;
+  typedef const T *const_iterator;
+
+  explicit mp_vector(struct mempool *pool, size_t n = 0)
+  : pool_(pool), ptr_(static_cast<T *>(mp_start(pool, n * sizeof(T)))), len_(0)
+  {
+  }
+
+  mp_vector(const mp_vector &) = delete;
+  mp_vector &operator=(const mp_vector &) = delete;
+
+  size_t size() const { return len_; }
+  bool empty() const { return !len_; }
+  size_t capacity() const { return mp_avail(pool_) / sizeof(T); }
+  T *data() { return ptr_; }
+  const T *data() const { return ptr_; }
+  T &operator[](size_t i) { return ptr_[i]; }
+  const T &operator[](size_t i) const { return ptr_[i]; }
+  T &back() { return ptr_[len_ - 1]; }
+  iterator begin() { return ptr_; }
+  iterator end() { return ptr_ + len_; }
+  const_iterator begin() const { return ptr_; }
+  const_iterator end() const { return ptr_ + len_; }
+
+  void reserve(size_t n)
+  {
+    if (n > capacity())
+      grow(n);
+  }
+
+  void push_back(const T &x)
+  {
+    if (len_ >= capacity())
+      {
+	T copy = x;		// <x> may be an element of the array
+	grow(len_ + 1);
+	ptr_[len_++] = copy;
+      }
+    else
+      ptr_[len_++] = x;
+  }
+
+  template <typename... Args>
+  T &emplace_back(Args &&... args)
+  {
+    if (len_ >= capacity())
+      grow(len_ + 1);
+    return *new (ptr_ + len_++) T(std::forward<Args>(args)...);
+  }
+
+  void pop_back() { len_--; }
+  void clear() { len_ = 0; }
+
+  /* New elements are value-initialized */
+  void resize(size_t n)
+  {
+    reserve(n);
+    for (size_t i = len_; i < n; i++)
+      new (ptr_ + i) T();
+    len_ = n;
+  }
+
+  /* Close the array like mp_vec_end(). The elements stay in the pool, the object must not be used any more. */
+  T *finish()
+  {
+    return static_cast<T *>(mp_end_fit(pool_, ptr_ + len_));
+  }
+};
+
+#endif
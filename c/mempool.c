@@ -1,16 +1,56 @@
+#define _GNU_SOURCE
+
 #include "mempool.h"
 
 #include <string.h>
+#include <sys/mman.h>
 
 #define CPU_PAGE_SIZE 4096
 #define MP_CHUNK_TAIL ALIGN_TO(sizeof(struct mempool_chunk), __BIGGEST_ALIGNMENT__)
 #define MP_SIZE_MAX (~0U - MP_CHUNK_TAIL - CPU_PAGE_SIZE)
 
+/* Big chunks of at least this size (including the tail) are mapped directly, so that
+ * growing buffers can be resized by mremap() without copying */
+#ifndef CONFIG_MP_MMAP_THRESHOLD
+#define CONFIG_MP_MMAP_THRESHOLD (1 << 20)
+#endif
+#define MP_MMAPPED(size) ((size) + MP_CHUNK_TAIL >= CONFIG_MP_MMAP_THRESHOLD)
+#define MP_MAPPED_TAIL ALIGN_TO(sizeof(struct mempool_mapped_chunk), __BIGGEST_ALIGNMENT__)
+
+/* Default limit of the cache of freed big chunks, see mp_set_big_cache() */
+#ifndef CONFIG_MP_BIG_CACHE
+#define CONFIG_MP_BIG_CACHE (4 << 20)
+#endif
+#define MP_BIG_BUCKETS 32
+
+/* Small chunks are colored by multiples of the cache line, see mp_set_colors() */
+#define MP_COLOR_STEP MAX(64, __BIGGEST_ALIGNMENT__)
+
+static uint mp_colors;
+static __thread uint mp_next_color;
+
 struct mempool_chunk {
   struct mempool_chunk *next;
   size_t size;
 };
 
+/* Tail of a mapped chunk, the mapping is <size> + MP_MAPPED_TAIL bytes long */
+struct mempool_mapped_chunk {
+  struct mempool_chunk chunk;
+  uint tag;				/* Accounting tag, see xalloc_account() */
+};
+
+static uint *
+mp_mapped_tag(struct mempool_chunk *chunk) {
+  return &((struct mempool_mapped_chunk *)chunk)->tag;
+}
+
+/* Bucket <i> holds chunks of sizes in [2^i, 2^(i+1)), the last one all bigger chunks as well */
+struct mp_big_cache {
+  size_t bytes;
+  struct mempool_chunk *bucket[MP_BIG_BUCKETS];
+};
+
 static size_t
 mp_align_size(size_t size) {
   return ALIGN_TO(size, __BIGGEST_ALIGNMENT__);
@@ -22,47 +62,216 @@ mp_init(struct mempool *pool, size_t chunk_size) {
   *pool = (struct mempool) {
     .chunk_size = chunk_size,
     .threshold = chunk_size >> 1,
-    .last_big = &pool->last_big
+    .last_big = &pool->last_big,
+    .supply = pool,
+    .big_cache_limit = CONFIG_MP_BIG_CACHE
   };
+  MP_TRACE(ATRACE_MP_NEW, pool, chunk_size);
 }
 
+/* Size of a mapped chunk using whole pages */
+static size_t
+mp_mmap_size(size_t size) {
+  return ALIGN_TO(size + MP_MAPPED_TAIL, CPU_PAGE_SIZE) - MP_MAPPED_TAIL;
+}
+
+/* The chunk can be bigger than requested, see chunk->size. Mapped chunks are always zeroed,
+ * others only if <zero> is set. */
 static void *
-mp_new_big_chunk(size_t size) {
+mp_new_big_chunk(size_t size, int zero) {
   struct mempool_chunk *chunk;
-  chunk = XMALLOC(size + MP_CHUNK_TAIL) + size;
+  if (MP_MMAPPED(size)) {
+    size = mp_mmap_size(size);
+    void *p = xalloc_may_alloc() ? mmap(NULL, size + MP_MAPPED_TAIL, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : MAP_FAILED;
+    if (p == MAP_FAILED)
+      FATAL(255, "Cannot map %zu bytes of memory", size + MP_MAPPED_TAIL);
+    chunk = p + size;
+    *mp_mapped_tag(chunk) = xalloc_tag();
+    xalloc_account(*mp_mapped_tag(chunk), size + MP_MAPPED_TAIL);
+  } else if (zero)
+    chunk = XCALLOC(size + MP_CHUNK_TAIL) + size;
+  else
+    chunk = XMALLOC(size + MP_CHUNK_TAIL) + size;
   chunk->size = size;
   return chunk;
 }
 
 static void
 mp_free_big_chunk(struct mempool_chunk *chunk) {
-  XFREE((void *)chunk - chunk->size);
+  if (MP_MMAPPED(chunk->size)) {
+    xalloc_account(*mp_mapped_tag(chunk), -(ssize_t)(chunk->size + MP_MAPPED_TAIL));
+    munmap((void *)chunk - chunk->size, chunk->size + MP_MAPPED_TAIL);
+  } else
+    XFREE((void *)chunk - chunk->size);
+}
+
+/* Resize a big chunk keeping its data. Mapped chunks are moved by mremap(),
+ * which remaps the pages instead of copying them. */
+static struct mempool_chunk *
+mp_resize_big_chunk(struct mempool_chunk *chunk, size_t size) {
+  struct mempool_chunk *next = chunk->next;
+  size_t old_size = chunk->size;
+  void *p = (void *)chunk - old_size;
+  if (MP_MMAPPED(size) && MP_MMAPPED(old_size)) {
+    uint tag = *mp_mapped_tag(chunk);
+    size = mp_mmap_size(size);
+    if (size > old_size && !xalloc_may_alloc())
+      p = MAP_FAILED;
+    else
+      p = mremap(p, old_size + MP_MAPPED_TAIL, size + MP_MAPPED_TAIL, MREMAP_MAYMOVE);
+    if (p == MAP_FAILED)
+      FATAL(255, "Cannot remap %zu bytes of memory", size + MP_MAPPED_TAIL);
+    chunk = p + size;
+    *mp_mapped_tag(chunk) = tag;
+    xalloc_account(tag, (ssize_t)size - (ssize_t)old_size);
+  } else if (MP_MMAPPED(size) || MP_MMAPPED(old_size)) {
+    chunk = mp_new_big_chunk(size, 0);
+    size = chunk->size;
+    memcpy((void *)chunk - size, p, MIN(size, old_size));
+    mp_free_big_chunk((void *)p + old_size);
+  } else
+    chunk = XREALLOC(p, size + MP_CHUNK_TAIL) + size;
+  chunk->next = next;
+  chunk->size = size;
+  return chunk;
+}
+
+static uint
+mp_big_bucket(size_t size) {
+  return MIN(63 - __builtin_clzll(size), MP_BIG_BUCKETS - 1);
+}
+
+/* Free cached big chunks of <supply>, the biggest ones first, until at most <limit> bytes stay */
+static void
+mp_trim_big_cache(struct mempool *supply, size_t limit) {
+  struct mp_big_cache *cache = supply->big_cache;
+  for (int i = MP_BIG_BUCKETS - 1; i >= 0 && cache->bytes > limit; i--)
+    while (cache->bucket[i] && cache->bytes > limit) {
+      struct mempool_chunk *chunk = cache->bucket[i];
+      cache->bucket[i] = chunk->next;
+      cache->bytes -= chunk->size;
+      mp_free_big_chunk(chunk);
+    }
+}
+
+/* Keep a freed big chunk in the cache of <supply>, or free it if it does not fit under the limit */
+static void
+mp_put_big_chunk(struct mempool *supply, struct mempool_chunk *chunk) {
+  if (chunk->size > supply->big_cache_limit) {
+    mp_free_big_chunk(chunk);
+    return;
+  }
+  if (!supply->big_cache)
+    supply->big_cache = XCALLOC(sizeof(struct mp_big_cache));
+  struct mp_big_cache *cache = supply->big_cache;
+  mp_trim_big_cache(supply, supply->big_cache_limit - chunk->size);
+  uint i = mp_big_bucket(chunk->size);
+  chunk->next = cache->bucket[i];
+  cache->bucket[i] = chunk;
+  cache->bytes += chunk->size;
+}
+
+/* Take a cached big chunk of at least <size> bytes from <supply>. Chunks of the next
+ * bucket are at most 4 times bigger than <size>, bigger ones are not used. */
+static struct mempool_chunk *
+mp_get_big_chunk(struct mempool *supply, size_t size) {
+  struct mp_big_cache *cache = supply->big_cache;
+  if (!cache || !cache->bytes)
+    return NULL;
+  uint i = mp_big_bucket(size);
+  struct mempool_chunk **prev = &cache->bucket[i];
+  while (*prev && (*prev)->size < size)
+    prev = &(*prev)->next;
+  if (!*prev && i + 1 < MP_BIG_BUCKETS)
+    prev = &cache->bucket[i + 1];
+  struct mempool_chunk *chunk = *prev;
+  if (chunk) {
+    *prev = chunk->next;
+    cache->bytes -= chunk->size;
+  }
+  return chunk;
+}
+
+void
+mp_set_big_cache(struct mempool *pool, size_t bytes) {
+  struct mempool *supply = pool->supply;
+  supply->big_cache_limit = bytes;
+  if (supply->big_cache)
+    mp_trim_big_cache(supply, bytes);
 }
 
+void
+mp_set_colors(uint colors) {
+  mp_colors = colors;
+}
+
+/* Small chunks are always allocated by malloc(). With coloring, the data start
+ * <color> bytes after the start of the block and chunk->size includes them, so
+ * the data of a small chunk always start at chunk - pool->chunk_size. */
 static void *
-mp_new_chunk(size_t size) {
-  return mp_new_big_chunk(size);
+mp_new_chunk(size_t size, int zero) {
+  struct mempool_chunk *chunk;
+  size_t color = mp_colors > 1 ? mp_next_color++ % mp_colors * MP_COLOR_STEP : 0;
+  size += color;
+  chunk = (zero ? XCALLOC(size + MP_CHUNK_TAIL) : XMALLOC(size + MP_CHUNK_TAIL)) + size;
+  chunk->size = size;
+  return chunk;
 }
 
 static void
 mp_free_chunk(struct mempool_chunk *chunk) {
-  mp_free_big_chunk(chunk);
+  XFREE((void *)chunk - chunk->size);
 }
 
-struct mempool *
-mp_new(size_t chunk_size) {
-  chunk_size = mp_align_size(MAX(sizeof(struct mempool), chunk_size));
-  struct mempool_chunk *chunk = mp_new_chunk(chunk_size);
+/* Take a chunk from the unused chain of the pool supplying chunks, or allocate a new one */
+static struct mempool_chunk *
+mp_get_chunk(struct mempool *pool) {
+  struct mempool *supply = pool->supply;
+  struct mempool_chunk *chunk = supply->unused;
+  if (chunk)
+    supply->unused = chunk->next;
+  else
+    chunk = mp_new_chunk(pool->chunk_size, 0);
+  return chunk;
+}
+
+static struct mempool *
+mp_new_in_chunk(struct mempool_chunk *chunk, size_t chunk_size, struct mempool *supply) {
   struct mempool *pool = (void *)chunk - chunk_size;
   chunk->next = NULL;
   *pool = (struct mempool) {
     .state = { .free = { chunk_size - sizeof(*pool) }, .last = { chunk } },
     .chunk_size = chunk_size,
     .threshold = chunk_size >> 1,
-    .last_big = &pool->last_big };
+    .last_big = &pool->last_big,
+    .supply = supply ? : pool,
+    .big_cache_limit = CONFIG_MP_BIG_CACHE };
+  MP_TRACE(ATRACE_MP_NEW, pool, chunk_size);
   return pool;
 }
 
+struct mempool *
+mp_new(size_t chunk_size) {
+  chunk_size = mp_align_size(MAX(sizeof(struct mempool), chunk_size));
+  return mp_new_in_chunk(mp_new_chunk(chunk_size, 0), chunk_size, NULL);
+}
+
+struct mempool *
+mp_new_child(struct mempool *parent) {
+  return mp_new_in_chunk(mp_get_chunk(parent), parent->chunk_size, parent->supply);
+}
+
+void
+mp_init_child(struct mempool *pool, struct mempool *parent) {
+  *pool = (struct mempool) {
+    .chunk_size = parent->chunk_size,
+    .threshold = parent->threshold,
+    .last_big = &pool->last_big,
+    .supply = parent->supply
+  };
+  MP_TRACE(ATRACE_MP_NEW, pool, pool->chunk_size);
+}
+
 static void
 mp_free_chain(struct mempool_chunk *chunk) {
   while (chunk) {
@@ -81,28 +290,64 @@ mp_free_big_chain(struct mempool_chunk *chunk) {
   }
 }
 
+/* Put a chain of big chunks to the cache of <supply> */
+static void
+mp_cache_big_chain(struct mempool *supply, struct mempool_chunk *chunk, struct mempool_chunk *stop) {
+  while (chunk != stop) {
+    struct mempool_chunk *next = chunk->next;
+    mp_put_big_chunk(supply, chunk);
+    chunk = next;
+  }
+}
+
+/* Return a chain of small chunks to the unused chain of <supply> */
+static void
+mp_return_chain(struct mempool *supply, struct mempool_chunk *chunk, struct mempool_chunk *stop) {
+  while (chunk != stop) {
+    struct mempool_chunk *next = chunk->next;
+    chunk->next = supply->unused;
+    supply->unused = chunk;
+    chunk = next;
+  }
+}
+
 void
 mp_delete(struct mempool *pool) {
+  MP_TRACE(ATRACE_MP_DELETE, pool, 0);
+  if (pool->supply != pool) {
+    mp_cache_big_chain(pool->supply, pool->state.last[1], NULL);
+    mp_return_chain(pool->supply, pool->state.last[0], NULL); // can contain the mempool structure
+    return;
+  }
   mp_free_big_chain(pool->state.last[1]);
+  if (pool->big_cache) {
+    for (uint i = 0; i < MP_BIG_BUCKETS; i++)
+      mp_free_big_chain(pool->big_cache->bucket[i]);
+    XFREE(pool->big_cache);
+  }
   mp_free_chain(pool->unused);
   mp_free_chain(pool->state.last[0]); // can contain the mempool structure
 }
 
 void
 mp_flush(struct mempool *pool) {
-  mp_free_big_chain(pool->state.last[1]);
+  MP_TRACE(ATRACE_MP_FLUSH, pool, 0);
+  mp_cache_big_chain(pool->supply, pool->state.last[1], NULL);
   struct mempool_chunk *chunk, *next;
-  for (chunk = pool->state.last[0]; chunk && (void *)chunk - chunk->size != pool; chunk = next) {
+  for (chunk = pool->state.last[0]; chunk && (void *)chunk - pool->chunk_size != pool; chunk = next) {
     next = chunk->next;
-    chunk->next = pool->unused;
-    pool->unused = chunk;
+    chunk->next = pool->supply->unused;
+    pool->supply->unused = chunk;
   }
   pool->state.last[0] = chunk;
-  pool->state.free[0] = chunk ? chunk->size - sizeof(*pool) : 0;
+  pool->state.free[0] = chunk ? pool->chunk_size - sizeof(*pool) : 0;
   pool->state.last[1] = NULL;
   pool->state.free[1] = 0;
   pool->state.next = NULL;
+  pool->state.intern = NULL;
+  pool->state.interned = 0;
   pool->last_big = &pool->last_big;
+  pool->zero[0] = pool->zero[1] = 0;
 }
 
 static void
@@ -121,18 +366,29 @@ mp_stats(struct mempool *pool, struct mempool_stats *stats) {
   mp_stats_chain(pool->state.last[0], stats, 0);
   mp_stats_chain(pool->state.last[1], stats, 1);
   mp_stats_chain(pool->unused, stats, 2);
+  if (pool->big_cache) {
+    for (uint i = 0; i < MP_BIG_BUCKETS; i++)
+      for (struct mempool_chunk *chunk = pool->big_cache->bucket[i]; chunk; chunk = chunk->next) {
+        stats->chain_size[3] += chunk->size + sizeof(*chunk);
+        stats->chain_count[3]++;
+      }
+    stats->total_size += stats->chain_size[3];
+  }
 }
 
-void *
-mp_alloc_internal(struct mempool *pool, size_t size) {
+/* With <zero> set, fresh chunks are requested zeroed */
+static void *
+mp_alloc_chunk(struct mempool *pool, size_t size, int zero) {
   struct mempool_chunk *chunk;
   if (size <= pool->threshold) {
     pool->idx = 0;
-    if (pool->unused) {
-       chunk = pool->unused;
-       pool->unused = chunk->next;
-    } else
-      chunk = mp_new_chunk(pool->chunk_size);
+    if (zero && !pool->supply->unused) {
+      chunk = mp_new_chunk(pool->chunk_size, 1);
+      pool->zero[0] = pool->chunk_size;
+    } else {
+      chunk = mp_get_chunk(pool);
+      pool->zero[0] = 0;
+    }
     chunk->next = pool->state.last[0];
     pool->state.last[0] = chunk;
     pool->state.free[0] = pool->chunk_size - size;
@@ -140,15 +396,33 @@ mp_alloc_internal(struct mempool *pool, size_t size) {
   } else if (likely(size <= MP_SIZE_MAX)) {
     pool->idx = 1;
     size_t aligned = ALIGN_TO(size, __BIGGEST_ALIGNMENT__);
-    chunk = mp_new_big_chunk(aligned);
+    if ((chunk = mp_get_big_chunk(pool->supply, aligned)))
+      pool->zero[1] = 0;
+    else {
+      chunk = mp_new_big_chunk(aligned, zero);
+      pool->zero[1] = zero || MP_MMAPPED(chunk->size) ? chunk->size : 0;
+    }
     chunk->next = pool->state.last[1];
     pool->state.last[1] = chunk;
-    pool->state.free[1] = aligned - size;
-    return pool->last_big = (void *)chunk - aligned;
+    pool->state.free[1] = chunk->size - size;
+    return pool->last_big = (void *)chunk - chunk->size;
   } else
     FATAL(255, "Cannot allocate %zu bytes from a mempool", size);
 }
 
+void *
+mp_alloc_internal(struct mempool *pool, size_t size) {
+  return mp_alloc_chunk(pool, size, 0);
+}
+
+/* Clear the part of a block of chunk <idx> not known to be zero */
+static void
+mp_clear(struct mempool *pool, size_t idx, void *ptr, size_t size) {
+  void *zero = pool->state.last[idx] - pool->zero[idx];
+  if (ptr < zero)
+    bzero(ptr, MIN(size, (size_t)(zero - ptr)));
+}
+
 void *
 mp_alloc(struct mempool *pool, size_t size) {
   return mp_alloc_fast(pool, size);
@@ -161,8 +435,18 @@ mp_alloc_noalign(struct mempool *pool, size_t size) {
 
 void *
 mp_alloc_zero(struct mempool *pool, size_t size) {
-  void *ptr = mp_alloc_fast(pool, size);
-  bzero(ptr, size);
+  MP_TRACE(ATRACE_MP_ALLOC, pool, size);
+  void *ptr;
+  size_t idx = 0;
+  size_t avail = pool->state.free[0] & ~(__BIGGEST_ALIGNMENT__ - 1);
+  if (size <= avail) {
+    pool->state.free[0] = avail - size;
+    ptr = pool->state.last[0] - avail;
+  } else {
+    ptr = mp_alloc_chunk(pool, size, 1);
+    idx = pool->idx;
+  }
+  mp_clear(pool, idx, ptr, size);
   return ptr;
 }
 
@@ -193,22 +477,52 @@ mp_grow_internal(struct mempool *pool, size_t size) {
     size_t amortized = likely(avail <= MP_SIZE_MAX / 2) ? avail * 2 : MP_SIZE_MAX;
     amortized = MAX(amortized, size);
     amortized = ALIGN_TO(amortized, __BIGGEST_ALIGNMENT__);
-    struct mempool_chunk *chunk = pool->state.last[1], *next = chunk->next;
-    ptr = XREALLOC(ptr, amortized + MP_CHUNK_TAIL);
-    chunk = ptr + amortized;
-    chunk->next = next;
-    chunk->size = amortized;
+    struct mempool_chunk *chunk = pool->state.last[1], *cached = NULL;
+    size_t old_size = chunk->size;
+    // Mappings are better grown by mremap() than copied to a cached chunk
+    if (!MP_MMAPPED(old_size) || !MP_MMAPPED(amortized))
+      cached = mp_get_big_chunk(pool->supply, amortized);
+    if (cached) {
+      cached->next = chunk->next;
+      memcpy((void *)cached - cached->size, ptr, avail);
+      mp_put_big_chunk(pool->supply, chunk);
+      chunk = cached;
+      pool->zero[1] = 0;
+    } else {
+      chunk = mp_resize_big_chunk(chunk, amortized);
+      // Pages added to a mapping are zero, the old tail remapped with the data lies before them
+      if (MP_MMAPPED(chunk->size) && chunk->size > old_size)
+        pool->zero[1] = chunk->size - old_size - (MP_MMAPPED(old_size) ? MP_MAPPED_TAIL : 0);
+      else
+        pool->zero[1] = 0;
+    }
+    ptr = (void *)chunk - chunk->size;
     pool->state.last[1] = chunk;
-    pool->state.free[1] = amortized;
+    pool->state.free[1] = chunk->size;
     pool->last_big = ptr;
     return ptr;
   } else {
+    pool->zero[0] = 0;	// The buffer being left could have been written anywhere
     void *p = mp_start_internal(pool, size);
     memcpy(p, ptr, avail);
+    pool->zero[pool->idx] = MIN(pool->zero[pool->idx], (size_t)(pool->state.last[pool->idx] - (p + avail)));
     return p;
   }
 }
 
+void *
+mp_end_fit(struct mempool *pool, void *end) {
+  void *ptr = mp_end(pool, end);
+  if (pool->idx && pool->state.free[1]) {
+    size_t size = end - ptr;
+    struct mempool_chunk *chunk = mp_resize_big_chunk(pool->state.last[1], ALIGN_TO(MAX(size, 1), __BIGGEST_ALIGNMENT__));
+    pool->state.last[1] = chunk;
+    pool->state.free[1] = chunk->size - size;
+    pool->last_big = ptr = (void *)chunk - chunk->size;
+  }
+  return ptr;
+}
+
 size_t
 mp_open(struct mempool *pool, void *ptr) {
   return mp_open_fast(pool, ptr);
@@ -224,7 +538,7 @@ mp_realloc_zero(struct mempool *pool, void *ptr, size_t size) {
   size_t old_size = mp_open_fast(pool, ptr);
   ptr = mp_grow(pool, size);
   if (size > old_size)
-    bzero(ptr + old_size, size - old_size);
+    mp_clear(pool, pool->idx, ptr + old_size, size - old_size);
   mp_end(pool, ptr + size);
   return ptr;
 }
@@ -238,19 +552,13 @@ mp_spread_internal(struct mempool *pool, void *p, size_t size) {
 
 void
 mp_restore(struct mempool *pool, struct mempool_state *state) {
-  struct mempool_chunk *chunk, *next;
+  MP_TRACE(ATRACE_MP_RESTORE, pool, (uintptr_t)state);
   struct mempool_state s = *state;
-  for (chunk = pool->state.last[0]; chunk != s.last[0]; chunk = next) {
-    next = chunk->next;
-    chunk->next = pool->unused;
-    pool->unused = chunk;
-  }
-  for (chunk = pool->state.last[1]; chunk != s.last[1]; chunk = next) {
-    next = chunk->next;
-    mp_free_big_chunk(chunk);
-  }
+  mp_return_chain(pool->supply, pool->state.last[0], s.last[0]);
+  mp_cache_big_chain(pool->supply, pool->state.last[1], s.last[1]);
   pool->state = s;
   pool->last_big = &pool->last_big;
+  pool->zero[0] = pool->zero[1] = 0;
 }
 
 struct mempool_state *
@@ -259,14 +567,15 @@ mp_push(struct mempool *pool) {
   struct mempool_state *p = mp_alloc_fast(pool, sizeof(*p));
   *p = state;
   pool->state.next = p;
+  MP_TRACE(ATRACE_MP_SAVE, pool, (uintptr_t)p);
   return p;
 }
 
 void
 mp_pop(struct mempool *pool) {
   assert(pool->state.next);
-  struct mempool_state state = pool->state;
-  mp_restore(pool, &state);
+  // The state pushed by mp_push(), its address identifies the traced state. mp_restore() copies it before freeing.
+  mp_restore(pool, pool->state.next);
 }
 
 char *
@@ -3,11 +3,21 @@
 #include "lib.h"
 #include <stdarg.h>
 
+/* Recording of allocation traces (see atrace.h), enabled by CONFIG_MP_TRACE */
+#ifdef CONFIG_MP_TRACE
+#include "atrace.h"
+#define MP_TRACE(op, pool, size) atrace_record(op, size, (uintptr_t)(pool))
+#else
+#define MP_TRACE(op, pool, size) do { } while (0)
+#endif
+
 /* Memory pool state (see mp_push(), ...) */
 struct mempool_state {
   size_t free[2];
   void *last[2];
   struct mempool_state *next;
+  struct mp_intern_table *intern;	/* Table of interned strings (see mp_intern()) */
+  size_t interned;			/* Number of strings interned before this state */
 };
 
 /* Memory pool */
@@ -15,13 +25,17 @@ struct mempool {
   struct mempool_state state;
   void *unused, *last_big;
   size_t chunk_size, threshold, idx;
+  struct mempool *supply;		/* Pool whose unused chain provides small chunks (the pool itself unless it is a child) */
+  size_t zero[2];			/* Number of bytes at the end of the last small/big chunk known to be zero */
+  struct mp_big_cache *big_cache;	/* Freed big chunks kept for reuse (see mp_set_big_cache()) */
+  size_t big_cache_limit;		/* Maximal size of the cached big chunks in bytes */
 };
 
 /* Statistics (see mp_stats()) */
 struct mempool_stats {
   size_t total_size;			/* Real allocated size in bytes */
-  size_t chain_count[3];			/* Number of allocated chunks in small/big/unused chains */
-  size_t chain_size[3];			/* Size of allocated chunks in small/big/unused chains */
+  size_t chain_count[4];			/* Number of allocated chunks in small/big/unused/cached big chains */
+  size_t chain_size[4];			/* Size of allocated chunks in small/big/unused/cached big chains */
 };
 
 /* Initialize a given mempool structure. Chunk size must be in the interval [1, UINT_MAX / 2] */
@@ -30,12 +44,40 @@ void mp_init(struct mempool *pool, size_t chunk_size);
 /* Allocate and initialize a new memory pool. See mp_init for chunk size limitations. */
 struct mempool *mp_new(size_t chunk_size);
 
+/* Allocate and initialize a child memory pool. The child takes its chunks from
+ * the unused chunks of the top-level ancestor of <parent> and returns them there
+ * when it is flushed, restored or deleted, so short-lived child pools reuse warm
+ * memory of the parent. The child has the same chunk size as the parent and it
+ * must be deleted before the parent. The pools must be used by one thread. */
+struct mempool *mp_new_child(struct mempool *parent);
+
+/* Initialize a given child mempool structure. See mp_new_child. */
+void mp_init_child(struct mempool *pool, struct mempool *parent);
+
 /* Cleanup mempool initialized by mp_init or mp_new */
 void mp_delete(struct mempool *pool);
 
 /* Free all data on a memory pool (saves some empty chunks for later allocations) */
 void mp_flush(struct mempool *pool);
 
+/* Big chunks (allocations above the threshold of the pool) freed by mp_flush(),
+ * mp_restore() or by deleting a child pool are kept in buckets by size and reused
+ * by later big allocations and by growing buffers in the big chain, instead of
+ * being returned to the allocator. The cache belongs to the pool supplying chunks,
+ * so all pools of one family share it. When the cached chunks exceed <bytes>,
+ * the biggest ones are freed; zero disables the cache. The default limit is
+ * CONFIG_MP_BIG_CACHE (4 MB). */
+void mp_set_big_cache(struct mempool *pool, size_t bytes);
+
+/* Cache coloring of small chunks: chunk sizes are usually powers of two, so the
+ * starts of all chunks (and the mempool structures in the first chunks) fall into
+ * the same cache sets. With <colors> > 1, the data of every new small chunk start
+ * after a rotating offset of 0 to <colors> - 1 cache lines, which costs up to that
+ * many lines of memory per chunk. Alignment of allocations is kept. Applies to
+ * chunks allocated after the call by all pools; it should be set before pools are
+ * used by more threads. Disabled by default. */
+void mp_set_colors(uint colors);
+
 /* Compute some statistics for debug purposes. See the definition of the mempool_stats structure. */
 void mp_stats(struct mempool *pool, struct mempool_stats *stats);
 
@@ -59,18 +101,22 @@ void *mp_alloc(struct mempool *pool, size_t size);
 /* The same as mp_alloc, but the result may not be aligned */
 void *mp_alloc_noalign(struct mempool *pool, size_t size);
 
-/* The same as mp_alloc, but fills the newly allocated data with zeroes */
+/* The same as mp_alloc, but fills the newly allocated data with zeroes.
+ * Memory known to be zero (fresh chunks, which this function gets by calloc()
+ * or mmap()) is not cleared again. Recycled chunks are cleared lazily, just
+ * the allocated part. */
 void *mp_alloc_zero(struct mempool *pool, size_t size);
 
 /* Inlined version of mp_alloc() */
 static inline void *
 mp_alloc_fast(struct mempool *pool, size_t size)
 {
+  MP_TRACE(ATRACE_MP_ALLOC, pool, size);
   size_t avail = pool->state.free[0] & ~(__BIGGEST_ALIGNMENT__ - 1);
   if (size <= avail)
     {
       pool->state.free[0] = avail - size;
-      return pool->state.last[0] - avail;
+      return (char *)pool->state.last[0] - avail;
     }
   else
     return mp_alloc_internal(pool, size);
@@ -80,9 +126,10 @@ mp_alloc_fast(struct mempool *pool, size_t size)
 static inline void *
 mp_alloc_fast_noalign(struct mempool *pool, size_t size)
 {
+  MP_TRACE(ATRACE_MP_ALLOC, pool, size);
   if (size <= pool->state.free[0])
     {
-      void *ptr = pool->state.last[0] - pool->state.free[0];
+      void *ptr = (char *)pool->state.last[0] - pool->state.free[0];
       pool->state.free[0] -= size;
       return ptr;
     }
@@ -128,7 +175,7 @@ mp_start_fast(struct mempool *pool, size_t size)
     {
       pool->idx = 0;
       pool->state.free[0] = avail;
-      return pool->state.last[0] - avail;
+      return (char *)pool->state.last[0] - avail;
     }
   else
     return mp_start_internal(pool, size);
@@ -141,7 +188,7 @@ mp_start_fast_noalign(struct mempool *pool, size_t size)
   if (size <= pool->state.free[0])
     {
       pool->idx = 0;
-      return pool->state.last[0] - pool->state.free[0];
+      return (char *)pool->state.last[0] - pool->state.free[0];
     }
   else
     return mp_start_internal(pool, size);
@@ -151,7 +198,7 @@ mp_start_fast_noalign(struct mempool *pool, size_t size)
 static inline void *
 mp_ptr(struct mempool *pool)
 {
-  return pool->state.last[pool->idx] - pool->state.free[pool->idx];
+  return (char *)pool->state.last[pool->idx] - pool->state.free[pool->idx];
 }
 
 /* Return the number of bytes available for extending the growing buffer */
@@ -183,7 +230,7 @@ mp_expand(struct mempool *pool)
 static inline void *
 mp_spread(struct mempool *pool, void *p, size_t size)
 {
-  return (((size_t)(pool->state.last[pool->idx] - p) >= size) ? p : mp_spread_internal(pool, p, size));
+  return (((size_t)((char *)pool->state.last[pool->idx] - (char *)p) >= size) ? p : mp_spread_internal(pool, p, size));
 }
 
 /* Close the growing buffer. The <end> must point just behind the data, you want to keep
@@ -193,16 +240,22 @@ static inline void *
 mp_end(struct mempool *pool, void *end)
 {
   void *p = mp_ptr(pool);
-  pool->state.free[pool->idx] = pool->state.last[pool->idx] - end;
+  pool->state.free[pool->idx] = (char *)pool->state.last[pool->idx] - (char *)end;
+  pool->zero[pool->idx] = 0;	/* The buffer could have been written beyond <end> */
   return p;
 }
 
+/* The same as mp_end(), but a buffer which has outgrown the chunks of the pool is
+ * shrunk to its size (the block may move). Use it to close buffers which are not
+ * going to grow any more. */
+void *mp_end_fit(struct mempool *pool, void *end);
+
 /* Return size in bytes of the last allocated memory block (with mp_alloc*() or mp_end()). */
 static inline size_t
 mp_size(struct mempool *pool, void *ptr)
 {
   size_t idx = mp_idx(pool, ptr);
-  return pool->state.last[idx] - ptr - pool->state.free[idx];
+  return (char *)pool->state.last[idx] - (char *)ptr - pool->state.free[idx];
 }
 
 /* Open the last memory block (allocated with mp_alloc*() or mp_end())
@@ -215,7 +268,7 @@ static inline size_t
 mp_open_fast(struct mempool *pool, void *ptr)
 {
   pool->idx = mp_idx(pool, ptr);
-  size_t size = pool->state.last[pool->idx] - ptr - pool->state.free[pool->idx];
+  size_t size = (char *)pool->state.last[pool->idx] - (char *)ptr - pool->state.free[pool->idx];
   pool->state.free[pool->idx] += size;
   return size;
 }
@@ -234,7 +287,7 @@ mp_realloc_fast(struct mempool *pool, void *ptr, size_t size)
 {
   mp_open_fast(pool, ptr);
   ptr = mp_grow(pool, size);
-  mp_end(pool, ptr + size);
+  mp_end(pool, (char *)ptr + size);
   return ptr;
 }
 
@@ -246,6 +299,7 @@ mp_realloc_fast(struct mempool *pool, void *ptr, size_t size)
 static inline void
 mp_save(struct mempool *pool, struct mempool_state *state)
 {
+  MP_TRACE(ATRACE_MP_SAVE, pool, (uintptr_t)state);
   *state = pool->state;
   pool->state.next = state;
 }
@@ -256,7 +310,8 @@ struct mempool_state *mp_push(struct mempool *pool);
 
 /* Restore the state saved by mp_save() or mp_push() and free all
  * data allocated after that point (including the state structure itself).
- * You can't reallocate the last memory block from the saved state. */
+ * You can't reallocate the last memory block from the saved state.
+ * Strings interned before the saved state stay interned, see mp_intern(). */
 void mp_restore(struct mempool *pool, struct mempool_state *state);
 
 /* Restore the state saved by the last call to mp_push().
@@ -283,3 +338,82 @@ char *mp_printf(struct mempool *mp, const char *fmt, ...) FORMAT_CHECK(printf,2,
 char *mp_vprintf(struct mempool *mp, const char *fmt, va_list args) LIKE_MALLOC;
 char *mp_printf_append(struct mempool *mp, char *ptr, const char *fmt, ...) FORMAT_CHECK(printf,3,4);
 char *mp_vprintf_append(struct mempool *mp, char *ptr, const char *fmt, va_list args);
+
+
+/*** mempool-intern.c ***/
+
+/* Return the canonical copy of the string <s> of <len> bytes stored in the pool,
+ * so interned strings are equal iff their pointers are equal. The copy is
+ * terminated by a zero byte. The strings and the hash table live in the pool
+ * and they are freed by mp_flush(). The saved states record the table, so
+ * mp_restore() keeps the strings interned before the saved state; the strings
+ * interned after it are removed from the table by the next call, which takes
+ * time proportional to the size of the table. A table which has grown stays
+ * in the pool, because saved states may refer to it: all old tables together
+ * are smaller than the current one. Do not call it with an opened growing
+ * buffer. */
+const char *mp_intern(struct mempool *pool, const char *s, size_t len);
+
+/* The same for a zero-terminated string */
+const char *mp_intern_str(struct mempool *pool, const char *s);
+
+
+/*** mempool-io.c ***/
+
+/* Read <fd> until its end into a new block of the pool and return the block,
+ * its size is stored to <len> (if not NULL). The data are read directly into
+ * the growing buffer, a regular file by one read() of its size; the block is
+ * terminated by a zero byte which is not counted in <len>. Returns NULL and
+ * sets errno on error. The descriptor has to be blocking. Do not call it with
+ * an opened growing buffer. */
+void *mp_read_fd(struct mempool *pool, int fd, size_t *len);
+
+/* The same for a file <name> */
+void *mp_read_file(struct mempool *pool, const char *name, size_t *len);
+
+/* Reader of delimited records (lines) from a file or a socket. The input is
+ * read into blocks of the pool and records are returned in place: the delimiter
+ * is replaced by a zero byte and the record stays allocated in the pool, so it
+ * is valid until the pool is flushed or restored. Reads start small and grow
+ * while they fill the buffer. Other allocations from the pool may be made
+ * between calls, but the unparsed rest of the input has to be copied after
+ * them then. The block of the reader is reopened by later reads, so the state
+ * of the pool must not be saved between calls, except right after
+ * mp_reader_restore(). */
+struct mp_reader {
+  struct mempool *pool;
+  int fd;
+  int eof;
+  int error;				/* errno of a failed read(), no more records are returned after it */
+  int big;				/* The block lies in the big chain */
+  int keep;				/* The block must not be reopened, the state may have been saved after it */
+  char *data;				/* Last block read, data[len] is zero */
+  size_t pos, len;			/* Unparsed rest of the block is data[pos, len) */
+  size_t scan;				/* Bytes of the rest known not to contain the delimiter */
+  size_t want;				/* Size of the next read */
+};
+
+void mp_reader_init(struct mp_reader *r, struct mempool *pool, int fd);
+
+/* Return the next record terminated by <delim> (the last one may be unterminated)
+ * and store its length without the delimiter to <len> (if not NULL). Returns NULL
+ * at the end of the input or after an error (see r->error). */
+char *mp_getdelim(struct mp_reader *r, size_t *len, int delim);
+
+/* The same for lines terminated by '\n' */
+char *mp_getline(struct mp_reader *r, size_t *len);
+
+/* Restore the pool like mp_restore(), but keep the unparsed rest of the input of
+ * the reader in a new block after the state. Records returned before are freed,
+ * the next restore to the same state frees the new block as well. This keeps the
+ * memory of a reader parsing a big input bounded:
+ *
+ *   mp_save(pool, &state);
+ *   while ((line = mp_getline(&r, &len))) {
+ *     process(line, len);
+ *     if (++n % 10000 == 0)
+ *       mp_reader_restore(&r, &state);
+ *   }
+ *
+ * Do not save the state again after the call, the new block would stay below it. */
+void mp_reader_restore(struct mp_reader *r, struct mempool_state *state);
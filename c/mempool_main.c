@@ -0,0 +1,464 @@
+/* Checks of mempool features, run with both allocation backends after blocks
+ * of odd sizes were allocated by the backend. Every allocation is checked to be
+ * aligned as promised and to keep the data written to it.
+ *
+ *	$ gcc -std=gnu11 -O2 -o mempool_main mempool_main.c mempool.c mempool-intern.c mempool-io.c xalloc.c -lpthread
+ *	$ ./mempool_main; echo $?
+ */
+
+#include "mempool-vector.h"
+
+#include <pthread.h>
+#include <string.h>
+
+static uint errors;
+static unsigned random_state = 1;
+
+#define CHECK(cond) do { if (!(cond) && errors++ < 20) fprintf(stderr, "%s: %s at line %d\n", section, #cond, __LINE__); } while (0)
+#define ALIGNED(p) !((uintptr_t)(p) % __BIGGEST_ALIGNMENT__)
+
+static const char *section;
+static void *odd_blocks[64];		/* Blocks of odd sizes allocated before the checks */
+
+static unsigned
+next_random(unsigned n) {
+  random_state = random_state * 1103515245 + 12345;
+  return (random_state >> 8) % n;
+}
+
+static void
+odd_blocks_alloc(void) {
+  for (uint i = 0; i < ARRAY_LEN(odd_blocks); i++)
+    odd_blocks[i] = XMALLOC(1 + 2 * (size_t)next_random(100));
+}
+
+static void
+odd_blocks_free(void) {
+  for (uint i = 0; i < ARRAY_LEN(odd_blocks); i++)
+    XFREE(odd_blocks[i]);
+}
+
+/* Allocate <size> bytes filled with <c> */
+static char *
+alloc_filled(struct mempool *pool, size_t size, int c) {
+  char *p = mp_alloc(pool, size);
+  CHECK(ALIGNED(p));
+  memset(p, c, size);
+  return p;
+}
+
+static int
+filled(const char *p, size_t size, int c) {
+  for (size_t i = 0; i < size; i++)
+    if (p[i] != (char)c)
+      return 0;
+  return 1;
+}
+
+static size_t
+unused_chunks(struct mempool *pool) {
+  struct mempool_stats stats;
+  mp_stats(pool, &stats);
+  return stats.chain_count[2];
+}
+
+/*** Child pools ***/
+
+static void
+check_children(void) {
+  section = "children";
+  struct mempool *parent = mp_new(4096);
+  char *p = alloc_filled(parent, 100, 'p');
+  size_t bytes = 0;
+  for (uint round = 0; round < 20; round++) {
+    struct mempool *child = mp_new_child(parent);
+    struct mempool *grandchild = mp_new_child(child);
+    char *blocks[64];
+    size_t sizes[64];
+    for (uint i = 0; i < ARRAY_LEN(blocks); i++) {
+      sizes[i] = 1 + i * 37 % 1000;	// The same in every round
+      blocks[i] = alloc_filled(i % 2 ? child : grandchild, sizes[i], i);
+    }
+    for (uint i = 0; i < ARRAY_LEN(blocks); i++)
+      CHECK(filled(blocks[i], sizes[i], i));
+    // Chunks of a flushed child go to the unused chain of the top-level pool
+    size_t unused = unused_chunks(parent);
+    mp_flush(grandchild);
+    CHECK(unused_chunks(parent) > unused);
+    CHECK(unused_chunks(child) == 0);
+    mp_delete(grandchild);
+    mp_delete(child);
+    // Once the family is warmed up, children do not allocate more memory
+    if (round == 1)
+      bytes = xalloc_tag_bytes(xalloc_tag());
+    else if (round > 1)
+      CHECK(xalloc_tag_bytes(xalloc_tag()) == bytes);
+  }
+  CHECK(filled(p, 100, 'p'));
+  mp_delete(parent);
+}
+
+/*** Growable arrays ***/
+
+static void
+check_vector(uint n) {
+  struct mempool *pool = mp_new(4096);
+  char *before = alloc_filled(pool, 10, 'b');
+  MP_VECTOR(uint) v;
+  mp_vec_start(&v, pool, 4);
+  CHECK(ALIGNED(v.ptr));
+  while (v.len < n) {
+    if (v.len % 100 == 99) {
+      uint k = MIN(10, n - v.len);
+      uint *p = mp_vec_extend(&v, k);
+      for (uint j = 0; j < k; j++)
+        p[j] = p - v.ptr + j;
+    } else {
+      uint *p = mp_vec_push(&v);
+      *p = p - v.ptr;
+    }
+    CHECK(ALIGNED(v.ptr));
+  }
+  // Reserved room is filled without moving the array
+  mp_vec_reserve(&v, v.len + 1000);
+  CHECK(mp_vec_capacity(&v) >= v.len + 1000);
+  uint *ptr = v.ptr;
+  for (uint i = 0; i < 1000; i++)
+    *mp_vec_push(&v) = n + i;
+  CHECK(v.ptr == ptr);
+  size_t len = v.len;
+  uint *a = mp_vec_end(&v);
+  CHECK(ALIGNED(a));
+  CHECK(len == n + 1000);
+  CHECK(mp_size(pool, a) == len * sizeof(*a));
+  // An array in the big chain is shrunk to its size
+  struct mempool_stats stats;
+  mp_stats(pool, &stats);
+  if (mp_idx(pool, a))
+    CHECK(stats.chain_size[1] < len * sizeof(*a) + 4096);
+  char *after = alloc_filled(pool, 100, 'a');
+  for (uint i = 0; i < len; i++)
+    CHECK(a[i] == i);
+  CHECK(filled(before, 10, 'b'));
+  CHECK(filled(after, 100, 'a'));
+  mp_delete(pool);
+}
+
+static void
+check_vectors(void) {
+  section = "vectors";
+  check_vector(10);
+  check_vector(1000);
+  check_vector(100000);		// In the big chain
+  check_vector(1000000);	// Mapped
+}
+
+/*** Cache of big chunks ***/
+
+static size_t
+cached_chunks(struct mempool *pool, size_t *bytes) {
+  struct mempool_stats stats;
+  mp_stats(pool, &stats);
+  if (bytes)
+    *bytes = stats.chain_size[3];
+  return stats.chain_count[3];
+}
+
+static void
+check_big_cache(void) {
+  section = "big cache";
+  struct mempool *pool = mp_new(4096);
+  char *a = alloc_filled(pool, 100000, 'a');
+  char *b = alloc_filled(pool, 200000, 'b');
+  mp_flush(pool);
+  CHECK(cached_chunks(pool, NULL) == 2);
+
+  // Freed big chunks are reused by allocations and growing buffers which fit
+  size_t bytes = xalloc_tag_bytes(xalloc_tag());
+  CHECK(alloc_filled(pool, 100000, 'c') == a);
+  char *p = mp_start(pool, 1000);
+  CHECK(ALIGNED(p));
+  p = mp_grow(pool, 150000);
+  CHECK(p == b);
+  mp_end(pool, p + 150000);
+  CHECK(cached_chunks(pool, NULL) == 0);
+  CHECK(xalloc_tag_bytes(xalloc_tag()) == bytes);
+  // Recycled chunks are cleared for zeroed allocations
+  mp_flush(pool);
+  char *z = mp_alloc_zero(pool, 100000);
+  CHECK(z == a);
+  CHECK(filled(z, 100000, 0));
+
+  // Chunks of children go to the cache of the top-level pool
+  mp_flush(pool);
+  struct mempool *child = mp_new_child(pool);
+  alloc_filled(child, 300000, 'd');
+  mp_delete(child);
+  CHECK(cached_chunks(pool, NULL) == 3);
+
+  // Lowering the limit frees the biggest chunks first, zero disables the cache
+  size_t cached;
+  bytes = xalloc_tag_bytes(xalloc_tag());
+  mp_set_big_cache(pool, 350000);
+  CHECK(cached_chunks(pool, &cached) == 2);
+  CHECK(cached <= 350000);
+  CHECK(xalloc_tag_bytes(xalloc_tag()) <= bytes - 300000);
+  CHECK(alloc_filled(pool, 100000, 'e') == a);
+  mp_set_big_cache(pool, 0);
+  CHECK(cached_chunks(pool, NULL) == 0);
+  alloc_filled(pool, 100000, 'f');
+  mp_flush(pool);
+  CHECK(cached_chunks(pool, NULL) == 0);
+  mp_delete(pool);
+}
+
+/*** Interning ***/
+
+#define INTERN_WORDS 3000
+
+static const char *
+word(uint i) {
+  static char buf[32];
+  sprintf(buf, "word-%u", i);
+  return buf;
+}
+
+/* Intern words [from, to) and check they are the strings in <interned> */
+static void
+check_words(struct mempool *pool, const char **interned, uint from, uint to) {
+  for (uint i = from; i < to; i++) {
+    const char *s = mp_intern_str(pool, word(i));
+    if (!interned[i])
+      interned[i] = s;
+    CHECK(s == interned[i]);
+    CHECK(!strcmp(s, word(i)));
+  }
+}
+
+static void
+check_intern(void) {
+  section = "intern";
+  struct mempool *pool = mp_new(4096);
+  const char *interned[INTERN_WORDS] = { 0 };
+  const char *a = mp_intern(pool, "ab\0c", 4);
+  CHECK(!memcmp(a, "ab\0c", 5));
+  CHECK(mp_intern(pool, "ab\0cd", 4) == a);
+  CHECK(mp_intern(pool, "ab", 2) != a);
+  char *copy = alloc_filled(pool, 3, 'x');
+  copy[2] = 0;
+  CHECK(mp_intern_str(pool, copy) == mp_intern_str(pool, "xx"));
+  check_words(pool, interned, 0, 100);
+
+  // Strings interned before a saved state stay interned after mp_restore(), also when the table grows in between
+  for (uint round = 0; round < 10; round++) {
+    struct mempool_state state;
+    mp_save(pool, &state);
+    uint to = 100 + round * 250;
+    check_words(pool, interned, 100, to);
+    check_words(pool, interned, 0, 100);
+    mp_restore(pool, &state);
+    for (uint i = 100; i < to; i++)
+      interned[i] = NULL;
+    check_words(pool, interned, 0, 100);
+    check_words(pool, interned, 100, 200);
+    check_words(pool, interned, 0, 200);
+    mp_restore(pool, &state);
+    for (uint i = 100; i < 200; i++)
+      interned[i] = NULL;
+  }
+
+  // Nested states
+  mp_push(pool);
+  check_words(pool, interned, 100, 1000);
+  mp_push(pool);
+  check_words(pool, interned, 1000, INTERN_WORDS);
+  mp_pop(pool);
+  for (uint i = 1000; i < INTERN_WORDS; i++)
+    interned[i] = NULL;
+  check_words(pool, interned, 0, INTERN_WORDS);
+  mp_pop(pool);
+  for (uint i = 100; i < INTERN_WORDS; i++)
+    interned[i] = NULL;
+  check_words(pool, interned, 0, INTERN_WORDS);
+  CHECK(mp_intern(pool, "ab\0c", 4) == a);
+
+  mp_flush(pool);
+  bzero(interned, sizeof(interned));
+  check_words(pool, interned, 0, 1000);
+  check_words(pool, interned, 0, 1000);
+  mp_delete(pool);
+}
+
+/*** Readers ***/
+
+#define INPUT_SIZE ((size_t)16 << 20)
+
+static char *input;			/* Lines of random lengths, the last one unterminated */
+static size_t input_len;
+
+static void
+make_input(void) {
+  input = XMALLOC(INPUT_SIZE);
+  input_len = 0;
+  while (input_len < INPUT_SIZE - 1000) {
+    uint len = next_random(8) ? next_random(300) : next_random(3000);
+    for (uint i = 0; i < len; i++)
+      input[input_len++] = 'a' + next_random(26);
+    input[input_len++] = '\n';
+  }
+  input[input_len++] = 'z';
+}
+
+/* Writes the input to a pipe in pieces of random sizes */
+static void *
+writer(void *arg) {
+  int fd = (intptr_t)arg;
+  unsigned state = 7;
+  for (size_t pos = 0; pos < input_len; ) {
+    state = state * 1103515245 + 12345;
+    size_t n = MIN(1 + (state >> 8) % 20000, input_len - pos);
+    ssize_t r = write(fd, input + pos, n);
+    if (r <= 0)
+      break;
+    pos += r;
+  }
+  close(fd);
+  return NULL;
+}
+
+static int
+start_writer(pthread_t *thread) {
+  int fds[2];
+  if (pipe(fds))
+    FATAL(1, "pipe: %m");
+  pthread_create(thread, NULL, writer, (void *)(intptr_t)fds[1]);
+  return fds[0];
+}
+
+/* Records returned since the last restore must stay intact */
+struct record {
+  const char *line;
+  size_t offset, len;
+};
+
+static void
+check_records(struct record *records, uint n) {
+  for (uint i = 0; i < n; i++)
+    CHECK(!memcmp(records[i].line, input + records[i].offset, records[i].len) && !records[i].line[records[i].len]);
+}
+
+/* Split the input from <fd> to lines, restoring the pool every <restore> lines */
+static void
+check_lines(int fd, uint restore) {
+  size_t base = xalloc_tag_bytes(xalloc_tag());
+  struct mempool *pool = mp_new(4096);
+  struct mempool_state state;
+  struct mp_reader r;
+  struct record records[1000];
+  uint n = 0, other_n = 0;
+  char *other = NULL;
+  size_t offset = 0, max_bytes = 0, len;
+  mp_reader_init(&r, pool, fd);
+  mp_save(pool, &state);
+  char *line;
+  while ((line = mp_getline(&r, &len))) {
+    char *end = memchr(input + offset, '\n', input_len - offset);
+    size_t expected = end ? (size_t)(end - input - offset) : input_len - offset;
+    CHECK(len == expected && !memcmp(line, input + offset, len) && !line[len]);
+    records[n++] = (struct record) { line, offset, len };
+    offset += len + 1;
+    // Other allocations between the calls move the rest of the input
+    if (n % 7 == 0)
+      other = alloc_filled(pool, 1 + n % 50, n), other_n = n;
+    if (n == MIN(restore, ARRAY_LEN(records))) {
+      check_records(records, n);
+      if (other)
+        CHECK(filled(other, 1 + other_n % 50, other_n));
+      max_bytes = MAX(max_bytes, xalloc_tag_bytes(xalloc_tag()) - base);
+      if (n == restore)
+        mp_reader_restore(&r, &state);
+      n = 0;
+      other = NULL;
+    }
+  }
+  check_records(records, n);
+  CHECK(offset == input_len + 1);
+  CHECK(!r.error);
+  // Restores keep the memory bounded
+  if (restore < ARRAY_LEN(records))
+    CHECK(max_bytes < INPUT_SIZE / 4);
+  mp_delete(pool);
+}
+
+static void
+check_reader(void) {
+  section = "reader";
+  make_input();
+  char name[] = "/tmp/mempool_main.XXXXXX";
+  int fd = mkstemp(name);
+  if (fd < 0 || write(fd, input, input_len) != (ssize_t)input_len)
+    FATAL(1, "Cannot write %s: %m", name);
+  struct mempool *pool = mp_new(4096);
+
+  // Whole inputs
+  size_t len;
+  char *p = mp_read_file(pool, name, &len);
+  CHECK(p && len == input_len && !memcmp(p, input, len) && !p[len]);
+  pthread_t thread;
+  int in = start_writer(&thread);
+  p = mp_read_fd(pool, in, &len);
+  CHECK(p && len == input_len && !memcmp(p, input, len) && !p[len]);
+  pthread_join(thread, NULL);
+  close(in);
+  mp_flush(pool);
+
+  // Lines split across reads of a file and of a pipe, with and without restores
+  for (uint restore = 100; restore <= 10000; restore *= 100) {
+    lseek(fd, 0, SEEK_SET);
+    check_lines(fd, restore);
+    in = start_writer(&thread);
+    check_lines(in, restore);
+    pthread_join(thread, NULL);
+    close(in);
+  }
+  close(fd);
+  unlink(name);
+
+  // Other delimiters, empty records
+  int fds[2];
+  if (pipe(fds) || write(fds[1], "a;;bc;", 6) != 6)
+    FATAL(1, "pipe: %m");
+  close(fds[1]);
+  struct mp_reader r;
+  mp_reader_init(&r, pool, fds[0]);
+  p = mp_getdelim(&r, &len, ';');
+  CHECK(p && len == 1 && !strcmp(p, "a"));
+  p = mp_getdelim(&r, &len, ';');
+  CHECK(p && len == 0 && !*p);
+  p = mp_getdelim(&r, &len, ';');
+  CHECK(p && len == 2 && !strcmp(p, "bc"));
+  CHECK(!mp_getdelim(&r, &len, ';') && r.eof && !r.error);
+  close(fds[0]);
+  mp_delete(pool);
+  XFREE(input);
+}
+
+static void
+run(const struct xalloc_backend *backend) {
+  xalloc_set_backend(backend);
+  odd_blocks_alloc();
+  check_children();
+  check_vectors();
+  check_big_cache();
+  check_intern();
+  check_reader();
+  odd_blocks_free();
+}
+
+int
+main(void) {
+  run(&xalloc_libc);
+  run(&xalloc_arena);
+  printf("%u errors\n", errors);
+  return !!errors;
+}
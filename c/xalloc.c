@@ -0,0 +1,323 @@
+#define _GNU_SOURCE
+
+#include "lib.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/*
+ * Every block starts with a header recording its size, accounting tag and
+ * backend, so blocks can be freed after the backend or the tag has changed.
+ * The header keeps the alignment of the block.
+ */
+
+struct xalloc_header {
+  size_t size;
+  uint32_t tag;
+  uint32_t backend;
+} __attribute__((aligned(__BIGGEST_ALIGNMENT__)));
+
+#define XALLOC_BACKENDS 8
+
+static const struct xalloc_backend *xalloc_backends[XALLOC_BACKENDS] = { &xalloc_libc };
+static uint xalloc_backend_count = 1;
+static uint xalloc_current;				/* Index of the backend used for new blocks */
+static pthread_mutex_t xalloc_backend_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t xalloc_bytes[XALLOC_TAGS];
+static const char *xalloc_names[XALLOC_TAGS] = { "untagged" };
+static __thread uint xalloc_thread_tag;
+static long xalloc_fail_countdown = -1;
+
+void
+xalloc_set_backend(const struct xalloc_backend *backend) {
+  pthread_mutex_lock(&xalloc_backend_lock);
+  uint i = 0;
+  while (i < xalloc_backend_count && xalloc_backends[i] != backend)
+    i++;
+  if (i == xalloc_backend_count) {
+    if (i == XALLOC_BACKENDS)
+      FATAL(255, "Too many allocation backends");
+    __atomic_store_n(&xalloc_backends[i], backend, __ATOMIC_RELEASE);
+    xalloc_backend_count++;
+  }
+  __atomic_store_n(&xalloc_current, i, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&xalloc_backend_lock);
+}
+
+uint
+xalloc_set_tag(uint tag) {
+  assert(tag < XALLOC_TAGS);
+  uint old = xalloc_thread_tag;
+  xalloc_thread_tag = tag;
+  return old;
+}
+
+uint
+xalloc_tag(void) {
+  return xalloc_thread_tag;
+}
+
+void
+xalloc_name_tag(uint tag, const char *name) {
+  assert(tag < XALLOC_TAGS);
+  xalloc_names[tag] = name;
+}
+
+size_t
+xalloc_tag_bytes(uint tag) {
+  assert(tag < XALLOC_TAGS);
+  return __atomic_load_n(&xalloc_bytes[tag], __ATOMIC_RELAXED);
+}
+
+void
+xalloc_dump(FILE *f) {
+  for (uint tag = 0; tag < XALLOC_TAGS; tag++) {
+    size_t bytes = xalloc_tag_bytes(tag);
+    if (bytes)
+      fprintf(f, "%2u %-20s %zu\n", tag, xalloc_names[tag] ? : "", bytes);
+  }
+}
+
+void
+xalloc_account(uint tag, ssize_t delta) {
+  __atomic_add_fetch(&xalloc_bytes[tag], delta, __ATOMIC_RELAXED);
+}
+
+void
+xalloc_fail_after(long n) {
+  __atomic_store_n(&xalloc_fail_countdown, n, __ATOMIC_RELAXED);
+}
+
+int
+xalloc_may_alloc(void) {
+  long n = __atomic_load_n(&xalloc_fail_countdown, __ATOMIC_RELAXED);
+  while (n >= 0) {
+    if (!n)
+      return 0;
+    if (__atomic_compare_exchange_n(&xalloc_fail_countdown, &n, n - 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      break;
+  }
+  return 1;
+}
+
+static void *
+xalloc_init_block(struct xalloc_header *h, size_t size, uint backend) {
+  if (!h)
+    return NULL;
+  h->size = size;
+  h->tag = xalloc_thread_tag;
+  h->backend = backend;
+  xalloc_account(h->tag, size);
+  return h + 1;
+}
+
+void *
+xalloc_malloc(size_t size) {
+  if (!xalloc_may_alloc())
+    return NULL;
+  uint b = __atomic_load_n(&xalloc_current, __ATOMIC_ACQUIRE);
+  return xalloc_init_block(xalloc_backends[b]->malloc(sizeof(struct xalloc_header) + size), size, b);
+}
+
+void *
+xalloc_calloc(size_t size) {
+  if (!xalloc_may_alloc())
+    return NULL;
+  uint b = __atomic_load_n(&xalloc_current, __ATOMIC_ACQUIRE);
+  return xalloc_init_block(xalloc_backends[b]->calloc(sizeof(struct xalloc_header) + size), size, b);
+}
+
+void *
+xalloc_realloc(void *ptr, size_t size) {
+  if (!ptr)
+    return xalloc_malloc(size);
+  if (!size) {
+    xalloc_free(ptr);
+    return NULL;
+  }
+  struct xalloc_header *h = (struct xalloc_header *)ptr - 1;
+  size_t old_size = h->size;
+  if (size > old_size && !xalloc_may_alloc())
+    return NULL;
+  uint tag = h->tag;
+  h = xalloc_backends[h->backend]->realloc(h, sizeof(*h) + old_size, sizeof(*h) + size);
+  if (!h)
+    return NULL;
+  h->size = size;
+  xalloc_account(tag, (ssize_t)size - (ssize_t)old_size);
+  return h + 1;
+}
+
+void
+xalloc_free(void *ptr) {
+  if (!ptr)
+    return;
+  struct xalloc_header *h = (struct xalloc_header *)ptr - 1;
+  xalloc_account(h->tag, -(ssize_t)h->size);
+  xalloc_backends[h->backend]->free(h, sizeof(*h) + h->size);
+}
+
+/*** libc ***/
+
+static void *
+xalloc_libc_malloc(size_t size) {
+  return malloc(size);
+}
+
+static void *
+xalloc_libc_calloc(size_t size) {
+  return calloc(1, size);
+}
+
+static void *
+xalloc_libc_realloc(void *ptr, size_t old_size UNUSED, size_t size) {
+  return realloc(ptr, size);
+}
+
+static void
+xalloc_libc_free(void *ptr, size_t size UNUSED) {
+  free(ptr);
+}
+
+const struct xalloc_backend xalloc_libc = {
+  .name = "libc",
+  .malloc = xalloc_libc_malloc,
+  .calloc = xalloc_libc_calloc,
+  .realloc = xalloc_libc_realloc,
+  .free = xalloc_libc_free,
+};
+
+/*** mmap arena ***/
+
+/*
+ * Blocks up to XALLOC_ARENA_MAX bytes are rounded up to size classes (four per
+ * power of two, so at most 25 % is wasted, plus the rounding of the smallest
+ * classes to __BIGGEST_ALIGNMENT__, which keeps every block carved after
+ * them aligned) and carved from regions of
+ * XALLOC_ARENA_REGION bytes mapped on demand. Freed blocks go to per-class free
+ * lists and are never returned to the OS. Bigger blocks are mapped one by one
+ * and grown by mremap(). One lock protects everything.
+ */
+
+#define CPU_PAGE_SIZE 4096
+#define XALLOC_ARENA_MIN 32
+#define XALLOC_ARENA_MAX (1 << 20)
+#define XALLOC_ARENA_REGION (64 << 20)
+#define XALLOC_ARENA_CLASSES 64
+
+struct xalloc_arena_free {
+  struct xalloc_arena_free *next;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  char *pos, *end;					/* Unused part of the last region */
+  struct xalloc_arena_free *free[XALLOC_ARENA_CLASSES];
+} xalloc_arena_state = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint
+xalloc_arena_class(size_t size) {
+  size = MAX(size, XALLOC_ARENA_MIN);
+  uint log = 63 - __builtin_clzll(size - 1);		/* 2^log < size <= 2^(log+1) */
+  uint quarter = (size - 1) >> (log - 2) & 3;		/* Quarters of 2^log above it */
+  return 4 * (log - 4) + quarter;
+}
+
+static size_t
+xalloc_arena_class_size(uint cls) {
+  uint log = cls / 4 + 4;
+  return ALIGN_TO(((size_t)1 << log) + ((size_t)(cls % 4 + 1) << (log - 2)), (size_t)__BIGGEST_ALIGNMENT__);
+}
+
+static size_t
+xalloc_arena_page_size(size_t size) {
+  return ALIGN_TO(size, (size_t)CPU_PAGE_SIZE);
+}
+
+static void *
+xalloc_arena_alloc(size_t size, int *fresh) {
+  if (size > XALLOC_ARENA_MAX) {
+    void *p = mmap(NULL, xalloc_arena_page_size(size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    *fresh = 1;
+    return p == MAP_FAILED ? NULL : p;
+  }
+  uint cls = xalloc_arena_class(size);
+  size = xalloc_arena_class_size(cls);
+  pthread_mutex_lock(&xalloc_arena_state.lock);
+  struct xalloc_arena_free *f = xalloc_arena_state.free[cls];
+  if (f) {
+    xalloc_arena_state.free[cls] = f->next;
+    *fresh = 0;
+  } else {
+    if ((size_t)(xalloc_arena_state.end - xalloc_arena_state.pos) < size) {
+      // The rest of the old region is lost
+      void *p = mmap(NULL, XALLOC_ARENA_REGION, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (p == MAP_FAILED) {
+        pthread_mutex_unlock(&xalloc_arena_state.lock);
+        return NULL;
+      }
+      xalloc_arena_state.pos = p;
+      xalloc_arena_state.end = p + XALLOC_ARENA_REGION;
+    }
+    f = (struct xalloc_arena_free *)xalloc_arena_state.pos;
+    xalloc_arena_state.pos += size;
+    *fresh = 1;
+  }
+  pthread_mutex_unlock(&xalloc_arena_state.lock);
+  return f;
+}
+
+static void *
+xalloc_arena_malloc(size_t size) {
+  int fresh;
+  return xalloc_arena_alloc(size, &fresh);
+}
+
+static void *
+xalloc_arena_calloc(size_t size) {
+  int fresh;
+  void *p = xalloc_arena_alloc(size, &fresh);
+  if (p && !fresh)
+    bzero(p, size);
+  return p;
+}
+
+static void
+xalloc_arena_free(void *ptr, size_t size) {
+  if (size > XALLOC_ARENA_MAX) {
+    munmap(ptr, xalloc_arena_page_size(size));
+    return;
+  }
+  uint cls = xalloc_arena_class(size);
+  struct xalloc_arena_free *f = ptr;
+  pthread_mutex_lock(&xalloc_arena_state.lock);
+  f->next = xalloc_arena_state.free[cls];
+  xalloc_arena_state.free[cls] = f;
+  pthread_mutex_unlock(&xalloc_arena_state.lock);
+}
+
+static void *
+xalloc_arena_realloc(void *ptr, size_t old_size, size_t size) {
+  if (old_size > XALLOC_ARENA_MAX && size > XALLOC_ARENA_MAX) {
+    void *p = mremap(ptr, xalloc_arena_page_size(old_size), xalloc_arena_page_size(size), MREMAP_MAYMOVE);
+    return p == MAP_FAILED ? NULL : p;
+  }
+  if (old_size <= XALLOC_ARENA_MAX && size <= XALLOC_ARENA_MAX && xalloc_arena_class(old_size) == xalloc_arena_class(size))
+    return ptr;
+  void *p = xalloc_arena_malloc(size);
+  if (!p)
+    return NULL;
+  memcpy(p, ptr, MIN(old_size, size));
+  xalloc_arena_free(ptr, old_size);
+  return p;
+}
+
+const struct xalloc_backend xalloc_arena = {
+  .name = "arena",
+  .malloc = xalloc_arena_malloc,
+  .calloc = xalloc_arena_calloc,
+  .realloc = xalloc_arena_realloc,
+  .free = xalloc_arena_free,
+};
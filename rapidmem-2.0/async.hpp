@@ -0,0 +1,170 @@
+#pragma once
+
+#include <atomic>
+#include <coroutine>
+#include <mutex>
+
+#include "cache.hpp"
+
+namespace rapidmem {
+
+/* Executor resuming coroutines directly on the thread calling free() or upkeep() */
+struct inline_executor {
+	void post(std::coroutine_handle<> handle) {
+		handle.resume();
+	}
+};
+
+/* Cache with allocation for C++20 coroutines: `co_await cache.async_alloc(executor)`
+ * suspends the coroutine while the cache is empty instead of spinning. Suspended
+ * coroutines wait in an intrusive FIFO list and get chunks in order of arrival from
+ * free() and upkeep(), which resume them by executor.post(std::coroutine_handle<>).
+ * An executor typically queues the handle to the event loop the coroutine runs on. */
+template <typename T, unsigned M = 4, typename Storage = heap_storage<T>, template <typename> class Queue = ring>
+class async_cache : public cache<T, M, Storage, Queue> {
+	typedef cache<T, M, Storage, Queue> base;
+
+	struct waiter {
+		waiter* next;
+		T* chunk;
+		std::coroutine_handle<> handle;
+		void* executor;
+		void (*post)(void* executor, std::coroutine_handle<> handle);
+	};
+
+	std::mutex lock_;
+	waiter* head_ = nullptr;
+	waiter* tail_ = nullptr;
+	std::atomic<::size_t> waiting_{0};
+
+	/* Hand chunks to waiters from the head of the list, lock_ must be held. Returns the list of served waiters. */
+	waiter* serve() {
+		waiter* served = nullptr;
+		waiter** last = &served;
+		while (head_) {
+			T* chunk = base::try_alloc();
+			if (!chunk)
+				break;
+			waiter* w = head_;
+			head_ = w->next;
+			if (!head_)
+				tail_ = nullptr;
+			waiting_.fetch_sub(1, std::memory_order_relaxed);
+			w->chunk = chunk;
+			w->next = nullptr;
+			*last = w;
+			last = &w->next;
+		}
+		return served;
+	}
+
+	static void resume(waiter* w) {
+		while (w) {
+			waiter* next = w->next;	// w may be gone once it is resumed
+			w->post(w->executor, w->handle);
+			w = next;
+		}
+	}
+
+	void wake() {
+		// Pairs with the fence in enqueue(): either we see the waiter, or the waiter sees our chunk
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!waiting_.load(std::memory_order_relaxed))
+			return;
+		waiter* served;
+		{
+			std::lock_guard<std::mutex> guard(lock_);
+			served = serve();
+		}
+		resume(served);
+	}
+
+	/* Returns true if the coroutine has to be suspended */
+	bool enqueue(waiter& self) {
+		waiter* served;
+		{
+			std::lock_guard<std::mutex> guard(lock_);
+			self.next = nullptr;
+			self.chunk = nullptr;
+			if (tail_)
+				tail_->next = &self;
+			else
+				head_ = &self;
+			tail_ = &self;
+			waiting_.fetch_add(1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			served = serve();
+		}
+		bool ready = false;
+		for (waiter** w = &served; *w; w = &(*w)->next) {
+			if (*w == &self) {
+				// Served right away, do not suspend
+				*w = self.next;
+				ready = true;
+				break;
+			}
+		}
+		resume(served);
+		return !ready;
+	}
+
+public:
+	template <typename Executor>
+	class awaiter {
+		async_cache& cache_;
+		Executor& executor_;
+		waiter waiter_;
+
+	public:
+		awaiter(async_cache& cache, Executor& executor)
+		: cache_(cache)
+		, executor_(executor) {
+			waiter_.chunk = nullptr;
+		}
+
+		bool await_ready() {
+			// Do not overtake suspended coroutines
+			if (cache_.waiting_.load(std::memory_order_relaxed))
+				return false;
+			waiter_.chunk = cache_.try_alloc();
+			return waiter_.chunk;
+		}
+
+		bool await_suspend(std::coroutine_handle<> handle) {
+			waiter_.handle = handle;
+			waiter_.executor = &executor_;
+			waiter_.post = [](void* executor, std::coroutine_handle<> handle) {
+				static_cast<Executor*>(executor)->post(handle);
+			};
+			return cache_.enqueue(waiter_);
+		}
+
+		T* await_resume() {
+			return waiter_.chunk;
+		}
+	};
+
+	using base::base;
+
+	template <typename Executor>
+	awaiter<Executor> async_alloc(Executor& executor) {
+		return awaiter<Executor>(*this, executor);
+	}
+
+	awaiter<inline_executor> async_alloc() {
+		static inline_executor executor;
+		return awaiter<inline_executor>(*this, executor);
+	}
+
+	void free(T* chunk) {
+		base::free(chunk);
+		wake();
+	}
+
+	void upkeep() {
+		base::upkeep();
+		wake();
+	}
+};
+
+} /* namespace rapidmem */
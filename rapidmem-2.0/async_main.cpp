@@ -0,0 +1,125 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <coroutine>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <thread>
+
+#include "async.hpp"
+
+namespace {
+
+rapidmem::async_cache<int> cache{4096, 16};
+
+typedef int* Chunk;
+
+/* Event loop of one thread, also the executor of its coroutines */
+class loop {
+	std::mutex lock_;
+	std::deque<std::coroutine_handle<>> ready_;
+
+public:
+	void post(std::coroutine_handle<> handle) {
+		std::lock_guard<std::mutex> guard(lock_);
+		ready_.push_back(handle);
+	}
+
+	auto yield() {
+		struct awaiter {
+			loop& loop_;
+			bool await_ready() { return false; }
+			void await_suspend(std::coroutine_handle<> handle) { loop_.post(handle); }
+			void await_resume() {}
+		};
+		return awaiter{*this};
+	}
+
+	void run(const std::atomic<int>& running) {
+		while (running.load()) {
+			std::coroutine_handle<> handle;
+			{
+				std::lock_guard<std::mutex> guard(lock_);
+				if (!ready_.empty()) {
+					handle = ready_.front();
+					ready_.pop_front();
+				}
+			}
+			if (handle)
+				handle.resume();
+			else
+				std::this_thread::yield();
+		}
+	}
+};
+
+struct task {
+	struct promise_type {
+		task get_return_object() { return {}; }
+		std::suspend_never initial_suspend() { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::abort(); }
+	};
+};
+
+std::atomic<int> running{0};
+
+task test(loop& lp, unsigned seed) {
+	std::default_random_engine rand(seed);
+	std::uniform_int_distribution<int> dist_8(0, 8 - 1);
+	std::uniform_int_distribution<int> dist_256(0, 256 - 1);
+	for (int i = 0; i < 100; ++i) {
+		const int chunks_num = dist_8(rand);
+		const int b = dist_256(rand); // Value that will be stored to every chunk
+
+		Chunk chunks[8];
+		for (int j = 0; j < chunks_num; ++j) {
+			chunks[j] = co_await cache.async_alloc(lp);
+			std::fill(chunks[j], chunks[j] + 4096, b);
+		}
+		co_await lp.yield();
+		for (int j = 0; j < chunks_num; ++j) {
+			for (int k = 0; k < 4096; ++k) {
+				if (chunks[j][k] != b) {
+					fprintf(stderr, "Difference: %d/%d/%d\n", i, j, k);
+					abort();
+				}
+			}
+		}
+		std::for_each(chunks, chunks + chunks_num, [](Chunk &chunk) { cache.free(chunk); });
+	}
+	running.fetch_sub(1);
+}
+
+std::atomic<bool> upkeep_run{true};
+void upkeep() {
+	while(upkeep_run.load()) {
+		cache.upkeep();
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+}
+
+} /* anonymous namespoace */
+
+int
+main(void) {
+	std::array<loop, 4> loops;
+	std::array<std::thread, 4> thes;
+	running.store(loops.size() * 250);
+	for (::size_t i = 0; i < thes.size(); ++i) {
+		thes[i] = std::thread{[i, &loops] {
+			for (int j = 0; j < 250; ++j)
+				test(loops[i], rand());
+			loops[i].run(running);
+		}};
+	}
+	std::thread the_upkeep{upkeep};
+	for(auto &the: thes) { the.join(); }
+	upkeep_run.store(false);
+	the_upkeep.join();
+	return 0;
+}
@@ -3,48 +3,70 @@
 #include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cmath>
 #include <cstdint>
+#include <memory>
+#include <thread>
 #include <type_traits>
+#include <utility>
 
 namespace rapidmem {
 
-template <typename T, unsigned M = 4>
-class cache {
-	static_assert(std::is_pod<T>::value, "Only PODs supported");
-	static_assert(M >= 3, "upkeep() not only alocates chunks but also frees them if there is more than (M-1)/M chunks in the queue");
+/* Storage of chunks allocated with new[] and freed with delete[] */
+template <typename T>
+struct heap_storage {
+	T* allocate(const ::size_t chunk_size) {
+		return new T[chunk_size];
+	}
 
-	::size_t chunk_size_;
-	::size_t chunks_num_;
-	std::atomic<::uint64_t> beg_, end_;
-	std::unique_ptr<std::atomic<T*>[]> queue_;
+	void deallocate(T* chunk, ::size_t) {
+		delete[] chunk;
+	}
+};
 
-	T* get_chunk() {
+/* Called by queue engines between claiming a position and filling or clearing
+ * its slot, i.e. where a preempted thread holds up the others. Benchmarks and
+ * tests may define it to inject delays. */
+#ifndef RAPIDMEM_PREEMPT_HOOK
+#define RAPIDMEM_PREEMPT_HOOK() do { } while (0)
+#endif
+
+/* Algorithm of ring over an array of <size> atomic slots holding values of type V,
+ * V{} marks an empty slot. beg and end only advance, a thread looks for the first
+ * occupied (free) slot from beg (end). A thread preempted after moving beg or end
+ * but before clearing or filling the slot leaves a hole the others have to scan
+ * over until it resumes. The slots and positions are passed in, so the queue can
+ * live in memory the algorithm does not own, e.g. in shared memory (shm_cache). */
+template <typename V>
+struct ring_algorithm {
+	/* Returns V{} if there is no value in the queue */
+	static V try_get(std::atomic<::uint64_t>& beg_, std::atomic<::uint64_t>& end_, std::atomic<V>* queue, const ::uint64_t size) {
 		::uint64_t slot;
-		T* chunk = nullptr;
+		V value{};
 		::uint64_t beg = beg_.load(std::memory_order_relaxed);
 		::uint64_t end = end_.load(std::memory_order_relaxed);
 		for (;;) {
+			// try_put() fills the slot at end without moving end, so it is scanned too
 			::uint64_t x = beg;
-			for (; x < end; ++x) {
-				slot = x % chunks_num_;
-				chunk = queue_[slot].load(std::memory_order_relaxed);
-				if (chunk)
+			for (; x <= end; ++x) {
+				slot = x % size;
+				value = queue[slot].load(std::memory_order_relaxed);
+				if (value != V{})
 					break;
 			}
 
-			if (x >= end) {
-				beg = beg_.load(std::memory_order_relaxed);
-				end = end_.load(std::memory_order_relaxed);
-				continue;
-			}
+			if (x > end)
+				return V{};
 
 			if (x > beg && !beg_.compare_exchange_strong(beg, x)) {
 				end = end_.load(std::memory_order_relaxed);
 				continue;
 			}
 
-			if (queue_[slot].compare_exchange_strong(chunk, nullptr)) {
-				return chunk;
+			RAPIDMEM_PREEMPT_HOOK();
+			if (queue[slot].compare_exchange_strong(value, V{})) {
+				return value;
 			} else {
 				beg = beg_.load(std::memory_order_relaxed);
 				end = end_.load(std::memory_order_relaxed);
@@ -53,33 +75,32 @@ class cache {
 		}
 	}
 
-	void put_chunk(T* chunk) {
+	/* Returns false if the queue is full */
+	static bool try_put(std::atomic<::uint64_t>& beg_, std::atomic<::uint64_t>& end_, std::atomic<V>* queue, const ::uint64_t size, const V value) {
 		::uint64_t slot;
-		T* prev_chunk = nullptr;
+		V prev_value{};
 		::uint64_t beg = beg_.load(std::memory_order_relaxed);
 		::uint64_t end = end_.load(std::memory_order_relaxed);
 		for (;;) {
 			::uint64_t y = end;
-			for (; y < beg + chunks_num_; ++y) {
-				slot = y % chunks_num_;
-				prev_chunk = queue_[slot].load(std::memory_order_relaxed);
-				if (!prev_chunk)
+			for (; y < beg + size; ++y) {
+				slot = y % size;
+				prev_value = queue[slot].load(std::memory_order_relaxed);
+				if (prev_value == V{})
 					break;
 			}
 
-			if (y >= beg + chunks_num_) {
-				beg = beg_.load(std::memory_order_relaxed);
-				end = end_.load(std::memory_order_relaxed);
-				continue;
-			}
+			if (y >= beg + size)
+				return false;
 
 			if (y > end && !end_.compare_exchange_strong(end, y)) {
 				beg = beg_.load(std::memory_order_relaxed);
 				continue;
 			}
 
-		 	if (queue_[slot].compare_exchange_strong(prev_chunk, chunk)) { // prev_chunk == nullptr
-				return;
+			RAPIDMEM_PREEMPT_HOOK();
+			if (queue[slot].compare_exchange_strong(prev_value, value)) { // prev_value == V{}
+				return true;
 			} else {
 				beg = beg_.load(std::memory_order_relaxed);
 				end = end_.load(std::memory_order_relaxed);
@@ -87,40 +108,232 @@ class cache {
 			}
 		}
 	}
+};
+
+/* Bounded queue of chunks used by the cache by default, slots hold chunks or nullptr
+ * (see ring_algorithm). */
+template <typename T>
+class ring {
+	::size_t size_;
+	std::atomic<::uint64_t> beg_, end_;
+	std::unique_ptr<std::atomic<T*>[]> queue_;
 
 public:
-	cache(const ::size_t chunk_size, const ::size_t min_chunks_num)
-	: chunk_size_(chunk_size)
-	, chunks_num_(M*min_chunks_num)
+	explicit ring(const ::size_t size)
+	: size_(size)
 	, beg_(0)
 	, end_(0)
-	, queue_(new std::atomic<T*>[chunks_num_]) {
-		assert(chunk_size_ > 0);
-		assert(chunks_num_ > 0);
+	, queue_(new std::atomic<T*>[size_]) {
+		std::fill(&queue_[0], &queue_[size_], nullptr);
+	}
 
-		std::fill(&queue_[0], &queue_[chunks_num_], nullptr);
+	/* Approximate number of chunks in the queue */
+	::size_t size() const {
+		const ::uint64_t beg = beg_.load(std::memory_order_relaxed);
+		const ::uint64_t end = end_.load(std::memory_order_relaxed);
+		return end > beg ? end - beg : 0;
 	}
 
-	void upkeep() {
+	/* Returns nullptr if there is no chunk in the queue */
+	T* try_get() {
+		return ring_algorithm<T*>::try_get(beg_, end_, queue_.get(), size_);
+	}
+
+	/* Returns false if the queue is full */
+	bool try_put(T* chunk) {
+		return ring_algorithm<T*>::try_put(beg_, end_, queue_.get(), size_, chunk);
+	}
+};
+
+/* Storage is called from upkeep() only. Its allocate() may return nullptr if it is exhausted.
+ * Queue is the engine of the bounded queue of free chunks, ring, seq_ring (see seq_ring.hpp)
+ * or stack (see stack.hpp). */
+template <typename T, unsigned M = 4, typename Storage = heap_storage<T>, template <typename> class Queue = ring>
+class cache {
+	static_assert(std::is_trivial<T>::value && std::is_standard_layout<T>::value, "Only PODs supported");
+	static_assert(M >= 3, "upkeep() not only alocates chunks but also frees them if there is more than (M-1)/M chunks in the queue");
+
+	::size_t chunk_size_;
+	::size_t chunks_num_;
+	Queue<T> queue_;
+	Storage storage_;
+
+	// Chunks allocated by upkeep() and not deleted yet, i.e. chunks in the queue plus chunks in use
+	std::atomic<::size_t> resident_;
+	std::atomic<::size_t> target_;
+	// Peak number of chunks in use, decays exponentially with half-life decay_
+	double demand_;
+	std::chrono::steady_clock::duration decay_;
+	std::chrono::steady_clock::time_point last_upkeep_;
+	// Chunks moved by one upkeep step run inline by alloc() and free(), zero if disabled
+	::size_t inline_step_;
+	// Held by the thread running upkeep(), inline or not
+	std::atomic<bool> upkeep_busy_;
+
+	void update_target() {
+		if (decay_ == decay_.zero()) {
+			target_.store(SIZE_MAX, std::memory_order_relaxed);
+			return;
+		}
+		const auto now = std::chrono::steady_clock::now();
+		const double elapsed = std::chrono::duration<double>(now - last_upkeep_).count();
+		last_upkeep_ = now;
+
+		const ::size_t queued = queue_.size();
+		const ::size_t resident = resident_.load(std::memory_order_relaxed);
+		const ::size_t in_use = resident > queued ? resident - queued : 0;
+		demand_ = std::max<double>(in_use, demand_ * std::exp2(-elapsed / std::chrono::duration<double>(decay_).count()));
+		target_.store(static_cast<::size_t>(std::ceil(demand_)) + chunks_num_/M, std::memory_order_relaxed);
+	}
+
+	T* get_chunk() {
 		for (;;) {
-			const ::uint64_t beg = beg_.load(std::memory_order_relaxed);
-			const ::uint64_t end = end_.load(std::memory_order_relaxed);
-			if (end > beg + (M-1)*chunks_num_/M) {
-				delete[] get_chunk();
-			} else if (end <= beg + chunks_num_/M) {
-				put_chunk(new T[chunk_size_]);
+			T* chunk = queue_.try_get();
+			if (chunk)
+				return chunk;
+		}
+	}
+
+	void put_chunk(T* chunk) {
+		while (!queue_.try_put(chunk))
+			;
+	}
+
+	/* Allocate or delete at most limit chunks, upkeep_busy_ must be held */
+	void upkeep_step(::size_t limit) {
+		update_target();
+		const ::size_t target = target_.load(std::memory_order_relaxed);
+		for (; limit > 0; --limit) {
+			const ::size_t queued = queue_.size();
+			const ::size_t resident = resident_.load(std::memory_order_relaxed);
+			if (queued > (M-1)*chunks_num_/M) {
+				storage_.deallocate(get_chunk(), chunk_size_);
+				resident_.store(resident - 1, std::memory_order_relaxed);
+			} else if (queued <= chunks_num_/M) {
+				T* chunk = storage_.allocate(chunk_size_);
+				if (!chunk)
+					break;
+				put_chunk(chunk);
+				resident_.store(resident + 1, std::memory_order_relaxed);
+			} else if (resident > target && queued > chunks_num_/M + 1) {
+				// Surplus left over from a past peak of demand
+				storage_.deallocate(get_chunk(), chunk_size_);
+				resident_.store(resident - 1, std::memory_order_relaxed);
 			} else {
 				break;
 			}
 		}
 	}
 
+	/* Called by alloc() and free() when the queue crossed a watermark. Only one
+	 * thread does the step, the others go on without waiting. */
+	void inline_upkeep() {
+		if (upkeep_busy_.exchange(true, std::memory_order_acquire))
+			return;
+		upkeep_step(inline_step_);
+		upkeep_busy_.store(false, std::memory_order_release);
+	}
+
+public:
+	typedef T value_type;
+
+	cache(const ::size_t chunk_size, const ::size_t min_chunks_num, Storage storage = Storage())
+	: chunk_size_(chunk_size)
+	, chunks_num_(M*min_chunks_num)
+	, queue_(chunks_num_)
+	, storage_(std::move(storage))
+	, resident_(0)
+	, target_(SIZE_MAX)
+	, demand_(0)
+	, decay_(std::chrono::seconds(10))
+	, last_upkeep_(std::chrono::steady_clock::now())
+	, inline_step_(0)
+	, upkeep_busy_(false) {
+		assert(chunk_size_ > 0);
+		assert(chunks_num_ > 0);
+	}
+
+	/* Waits for an upkeep step run inline by another thread, see inline_upkeep() */
+	void upkeep() {
+		while (upkeep_busy_.exchange(true, std::memory_order_acquire))
+			std::this_thread::yield();
+		upkeep_step(SIZE_MAX);
+		upkeep_busy_.store(false, std::memory_order_release);
+	}
+
+	/* Let alloc() and free() do the work of upkeep() without a dedicated thread:
+	 * when the queue is at most 1/M full (more than (M-1)/M full) or empty (full),
+	 * the first caller which gets the upkeep lock allocates (deletes) up to step
+	 * chunks before returning, the others do not wait for it. The cost of refilling
+	 * the cache is then spread over the callers, but alloc() and free() allocate
+	 * and free memory. Zero turns it off; upkeep() can still be called. Set it
+	 * before the cache is used by other threads. */
+	void inline_upkeep(const ::size_t step) {
+		inline_step_ = step;
+	}
+
+	/* Set the half-life of the demand estimate used for returning surplus chunks
+	 * in upkeep(). Zero disables returning chunks below the (M-1)/M watermark. */
+	void decay(std::chrono::steady_clock::duration half_life) {
+		decay_ = half_life;
+	}
+
+	/* Number of chunks allocated by upkeep() -- chunks in the cache plus chunks in use */
+	::size_t resident_chunks() const {
+		return resident_.load(std::memory_order_relaxed);
+	}
+
+	/* Number of chunks upkeep() shrinks the cache to */
+	::size_t target_chunks() const {
+		return target_.load(std::memory_order_relaxed);
+	}
+
 	T* alloc() {
-		return get_chunk();
+		if (!inline_step_)
+			return get_chunk();
+		for (;;) {
+			T* chunk = try_alloc();
+			if (chunk)
+				return chunk;
+		}
 	}
 
 	void free(T* chunk) {
-		put_chunk(chunk);
+		if (!inline_step_)
+			put_chunk(chunk);
+		else
+			while (!try_free(chunk))
+				;
+	}
+
+	/* Non-blocking variant of alloc(), returns nullptr if the cache is empty */
+	T* try_alloc() {
+		T* chunk = queue_.try_get();
+		if (inline_step_ && (!chunk || queue_.size() <= chunks_num_/M)) {
+			inline_upkeep();
+			if (!chunk)
+				chunk = queue_.try_get();
+		}
+		return chunk;
+	}
+
+	/* Non-blocking variant of free(), returns false if the cache is full */
+	bool try_free(T* chunk) {
+		bool done = queue_.try_put(chunk);
+		if (inline_step_ && (!done || queue_.size() > (M-1)*chunks_num_/M)) {
+			inline_upkeep();
+			if (!done)
+				done = queue_.try_put(chunk);
+		}
+		return done;
+	}
+
+	::size_t chunk_size() const {
+		return chunk_size_;
+	}
+
+	Storage& storage() {
+		return storage_;
 	}
 };
 
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "cache.hpp"
+
+namespace rapidmem {
+
+/* Cache with epoch-based reclamation for lock-free readers: a chunk passed to
+ * retire() goes back to the cache only when no reader can hold it any more.
+ *
+ *	rapidmem::epoch_cache<rapidmem::cache<char>> cache{4096, 1024};
+ *	const unsigned r = cache.attach();		// Once per reader thread
+ *	{
+ *		rapidmem::epoch_cache<rapidmem::cache<char>>::guard g{cache, r};
+ *		// Read chunks reachable from shared pointers
+ *	}
+ *	cache.retire(old);				// After unlinking <old>
+ *
+ * Readers announce the global epoch in their slots while they are in a critical
+ * section. upkeep() advances the epoch when all readers in critical sections
+ * have announced the current one and collects chunks retired since the last
+ * call into the batch of the current epoch. A batch goes back to the cache two
+ * epochs later: by then every reader that was in a critical section when its
+ * chunks were collected has left it. A reader staying in its critical section
+ * holds up reclamation, the retired chunks wait meanwhile.
+ *
+ * Readers may still read a retired chunk, so retire() does not touch it: the
+ * pointer goes to a vector under a short lock. Critical sections do not nest. */
+template <typename Cache, unsigned Readers = 64>
+class epoch_cache : public Cache {
+	typedef typename Cache::value_type T;
+
+	static constexpr ::uint64_t idle = 0;
+
+	struct alignas(64) slot {
+		std::atomic<bool> attached{false};
+		// Epoch * 2 + 1 while in a critical section, idle otherwise
+		std::atomic<::uint64_t> state{idle};
+	};
+
+	slot slots_[Readers];
+	alignas(64) std::atomic<::uint64_t> epoch_{0};
+	// Chunks retired since the last upkeep()
+	alignas(64) std::mutex retire_lock_;
+	std::vector<T*> retired_;
+	std::atomic<::size_t> pending_{0};
+	// Batches of the last three epochs, limbo_[e % 3] holds the chunks collected in epoch e
+	std::mutex reclaim_lock_;
+	std::vector<T*> limbo_[3];
+
+	/* Returns false if a reader in a critical section has not announced the current epoch */
+	bool can_advance(const ::uint64_t epoch) const {
+		for (const slot& s : slots_) {
+			// Acquire: reads of a reader which has left happen before the chunks are reused
+			const ::uint64_t state = s.state.load(std::memory_order_acquire);
+			if (state != idle && state != (epoch << 1 | 1))
+				return false;
+		}
+		return true;
+	}
+
+	void release(std::vector<T*>& batch) {
+		for (T* chunk : batch) {
+			while (!Cache::try_free(chunk))
+				Cache::upkeep();
+		}
+		pending_.fetch_sub(batch.size(), std::memory_order_relaxed);
+		batch.clear();
+	}
+
+	void reclaim() {
+		std::lock_guard<std::mutex> guard(reclaim_lock_);
+		// Pairs with the fence in enter(): a reader not seen here sees the chunks unlinked
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		::uint64_t epoch = epoch_.load(std::memory_order_relaxed);
+		if (can_advance(epoch))
+			epoch_.store(++epoch, std::memory_order_relaxed);
+		// Collected two epochs ago
+		release(limbo_[(epoch + 1) % 3]);
+
+		std::lock_guard<std::mutex> retire_guard(retire_lock_);
+		std::vector<T*>& batch = limbo_[epoch % 3];
+		batch.insert(batch.end(), retired_.begin(), retired_.end());
+		retired_.clear();
+	}
+
+public:
+	using Cache::Cache;
+
+	/* Claim a reader slot, returns Readers if all slots are taken */
+	unsigned attach() {
+		for (unsigned r = 0; r < Readers; ++r) {
+			bool attached = false;
+			if (slots_[r].attached.compare_exchange_strong(attached, true, std::memory_order_relaxed))
+				return r;
+		}
+		return Readers;
+	}
+
+	void detach(const unsigned r) {
+		assert(slots_[r].state.load(std::memory_order_relaxed) == idle);
+		slots_[r].attached.store(false, std::memory_order_relaxed);
+	}
+
+	/* Enter a critical section of reader slot r */
+	void enter(const unsigned r) {
+		slots_[r].state.store(epoch_.load(std::memory_order_relaxed) << 1 | 1, std::memory_order_release);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+
+	void leave(const unsigned r) {
+		slots_[r].state.store(idle, std::memory_order_release);
+	}
+
+	/* Critical section for the lifetime of the object */
+	class guard {
+		epoch_cache& cache_;
+		const unsigned r_;
+
+	public:
+		guard(epoch_cache& cache, const unsigned r)
+		: cache_(cache)
+		, r_(r) {
+			cache_.enter(r_);
+		}
+
+		guard(const guard&) = delete;
+		guard& operator=(const guard&) = delete;
+
+		~guard() {
+			cache_.leave(r_);
+		}
+	};
+
+	/* Return a chunk no longer reachable by new readers. It goes back to the cache
+	 * in the upkeep() after all current readers have left their critical sections. */
+	void retire(T* chunk) {
+		std::lock_guard<std::mutex> guard(retire_lock_);
+		retired_.push_back(chunk);
+		pending_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	/* Advance the epoch if possible, return chunks retired two epochs ago to the cache, then do the upkeep of the cache */
+	void upkeep() {
+		reclaim();
+		Cache::upkeep();
+	}
+
+	/* Number of retired chunks not returned to the cache yet */
+	::size_t retired_chunks() const {
+		return pending_.load(std::memory_order_relaxed);
+	}
+
+	::uint64_t epoch() const {
+		return epoch_.load(std::memory_order_relaxed);
+	}
+};
+
+} /* namespace rapidmem */
@@ -0,0 +1,82 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "epoch.hpp"
+
+/* Readers check snapshots published by writers through one shared pointer.
+ * Every snapshot is a chunk filled with its version; a writer replaces the
+ * snapshot and retires the old one. A chunk reused while a reader holds it
+ * would be overwritten with another version under the reader's hands. */
+
+namespace {
+
+constexpr ::size_t chunk_size = 1024;
+
+rapidmem::epoch_cache<rapidmem::cache<::uint64_t>> cache{chunk_size, 64};
+std::atomic<::uint64_t*> snapshot{nullptr};
+std::atomic<bool> run{true};
+std::atomic<bool> upkeep_run{true};	// Writers may wait for chunks from upkeep() until they stop
+std::atomic<::uint64_t> errors{0};
+std::atomic<::uint64_t> reads{0};
+
+::uint64_t* make(const ::uint64_t version) {
+	::uint64_t* chunk = cache.alloc();
+	for (::size_t i = 0; i < chunk_size; ++i)
+		__atomic_store_n(&chunk[i], version, __ATOMIC_RELAXED);
+	return chunk;
+}
+
+void reader() {
+	const unsigned r = cache.attach();
+	::uint64_t n = 0;
+	while (run.load(std::memory_order_relaxed)) {
+		decltype(cache)::guard g{cache, r};
+		const ::uint64_t* chunk = snapshot.load(std::memory_order_acquire);
+		const ::uint64_t version = __atomic_load_n(&chunk[0], __ATOMIC_RELAXED);
+		for (::size_t i = 1; i < chunk_size; ++i)
+			if (__atomic_load_n(&chunk[i], __ATOMIC_RELAXED) != version)
+				errors.fetch_add(1, std::memory_order_relaxed);
+		++n;
+	}
+	cache.detach(r);
+	reads.fetch_add(n);
+}
+
+void writer(const unsigned id) {
+	for (::uint64_t version = id; run.load(std::memory_order_relaxed); version += 16) {
+		::uint64_t* old = snapshot.exchange(make(version), std::memory_order_acq_rel);
+		cache.retire(old);
+	}
+}
+
+} /* anonymous namespace */
+
+int
+main(void) {
+	cache.upkeep();
+	snapshot.store(make(0));
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < 4; ++i)
+		threads.emplace_back(reader);
+	for (unsigned i = 0; i < 2; ++i)
+		threads.emplace_back(writer, i + 1);
+	std::thread upkeep([] {
+		while (upkeep_run.load(std::memory_order_relaxed)) {
+			cache.upkeep();
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+	});
+	std::this_thread::sleep_for(std::chrono::seconds(2));
+	run.store(false);
+	for (std::thread& thread : threads)
+		thread.join();
+	upkeep_run.store(false);
+	upkeep.join();
+	std::printf("%llu reads, epoch %llu, %zu chunks still retired, %llu errors\n",
+		static_cast<unsigned long long>(reads.load()), static_cast<unsigned long long>(cache.epoch()),
+		cache.retired_chunks(), static_cast<unsigned long long>(errors.load()));
+	return errors.load() != 0;
+}
@@ -0,0 +1,257 @@
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+#include "io_pool.hpp"
+
+namespace {
+
+/* Minimal io_uring without liburing: one submitter, no SQ polling */
+class uring {
+	int fd_ = -1;
+	unsigned entries_;
+	unsigned* sq_head_; unsigned* sq_tail_; unsigned* sq_mask_; unsigned* sq_array_;
+	unsigned* cq_head_; unsigned* cq_tail_; unsigned* cq_mask_;
+	::io_uring_sqe* sqes_;
+	::io_uring_cqe* cqes_;
+	void* sq_ptr_; ::size_t sq_len_;
+	void* cq_ptr_; ::size_t cq_len_;
+	::size_t sqes_len_;
+	unsigned tail_;
+	unsigned to_submit_ = 0;
+
+public:
+	explicit uring(unsigned entries) {
+		::io_uring_params p;
+		std::memset(&p, 0, sizeof(p));
+		fd_ = ::syscall(__NR_io_uring_setup, entries, &p);
+		if (fd_ < 0)
+			return;
+		entries_ = p.sq_entries;
+		sq_len_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		cq_len_ = p.cq_off.cqes + p.cq_entries * sizeof(::io_uring_cqe);
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+			sq_len_ = cq_len_ = std::max(sq_len_, cq_len_);
+		sq_ptr_ = ::mmap(nullptr, sq_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+		cq_ptr_ = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq_ptr_
+			: ::mmap(nullptr, cq_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+		sqes_len_ = p.sq_entries * sizeof(::io_uring_sqe);
+		void* sqes = ::mmap(nullptr, sqes_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+		if (sq_ptr_ == MAP_FAILED || cq_ptr_ == MAP_FAILED || sqes == MAP_FAILED) {
+			::close(fd_);
+			fd_ = -1;
+			return;
+		}
+		char* sq = static_cast<char*>(sq_ptr_);
+		char* cq = static_cast<char*>(cq_ptr_);
+		sq_head_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+		sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+		sq_mask_ = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+		sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+		cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+		cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+		cq_mask_ = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+		cqes_ = reinterpret_cast<::io_uring_cqe*>(cq + p.cq_off.cqes);
+		sqes_ = static_cast<::io_uring_sqe*>(sqes);
+		tail_ = *sq_tail_;
+	}
+
+	~uring() {
+		if (fd_ < 0)
+			return;
+		::munmap(sqes_, sqes_len_);
+		if (cq_ptr_ != sq_ptr_)
+			::munmap(cq_ptr_, cq_len_);
+		::munmap(sq_ptr_, sq_len_);
+		::close(fd_);
+	}
+
+	explicit operator bool() const {
+		return fd_ >= 0;
+	}
+
+	bool register_buffers(const std::vector<::iovec>& iov) {
+		return ::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS, iov.data(), iov.size()) == 0;
+	}
+
+	::io_uring_sqe* get_sqe() {
+		if (tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= entries_)
+			return nullptr;
+		const unsigned idx = tail_++ & *sq_mask_;
+		sq_array_[idx] = idx;
+		++to_submit_;
+		::io_uring_sqe* sqe = &sqes_[idx];
+		std::memset(sqe, 0, sizeof(*sqe));
+		return sqe;
+	}
+
+	/* Submit prepared entries and wait for at least <wait> completions */
+	int submit(unsigned wait) {
+		__atomic_store_n(sq_tail_, tail_, __ATOMIC_RELEASE);
+		const int ret = ::syscall(__NR_io_uring_enter, fd_, to_submit_, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+		if (ret > 0)
+			to_submit_ -= ret;
+		return ret;
+	}
+
+	bool peek(::io_uring_cqe& cqe) {
+		const unsigned head = *cq_head_;
+		if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+			return false;
+		cqe = cqes_[head & *cq_mask_];
+		__atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+};
+
+struct options {
+	const char* path = "io_bench.dat";
+	::size_t size = 256 << 20;
+	::size_t block = 64 << 10;
+	unsigned depth = 32;
+};
+
+double mb_per_s(const options& opts, std::chrono::steady_clock::time_point beg) {
+	const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - beg).count();
+	return opts.size / secs / (1 << 20);
+}
+
+void check(bool ok, const char* what) {
+	if (!ok) {
+		std::perror(what);
+		std::exit(1);
+	}
+}
+
+/* Buffered I/O through the page cache. The cache is dropped before reading. */
+void bench_buffered(const options& opts) {
+	std::vector<char> buf(opts.block, 'b');
+	int fd = ::open(opts.path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	check(fd >= 0, opts.path);
+
+	auto beg = std::chrono::steady_clock::now();
+	for (::size_t off = 0; off < opts.size; off += opts.block)
+		check(::pwrite(fd, buf.data(), opts.block, off) == static_cast<::ssize_t>(opts.block), "pwrite");
+	check(::fsync(fd) == 0, "fsync");
+	const double write_mbs = mb_per_s(opts, beg);
+
+	::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	beg = std::chrono::steady_clock::now();
+	for (::size_t off = 0; off < opts.size; off += opts.block)
+		check(::pread(fd, buf.data(), opts.block, off) == static_cast<::ssize_t>(opts.block), "pread");
+	std::printf("%-22s write %8.1f MB/s  read %8.1f MB/s\n", "buffered", write_mbs, mb_per_s(opts, beg));
+	::close(fd);
+}
+
+/* O_DIRECT, one request at a time, buffers from the pool */
+void bench_direct(const options& opts, rapidmem::io_cache<>& pool) {
+	int fd = ::open(opts.path, O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	check(fd >= 0, opts.path);
+
+	auto beg = std::chrono::steady_clock::now();
+	for (::size_t off = 0; off < opts.size; off += opts.block) {
+		char* chunk = pool.alloc();
+		std::memset(chunk, 'd', opts.block);
+		check(::pwrite(fd, chunk, opts.block, off) == static_cast<::ssize_t>(opts.block), "pwrite");
+		pool.free(chunk);
+	}
+	check(::fsync(fd) == 0, "fsync");
+	const double write_mbs = mb_per_s(opts, beg);
+
+	beg = std::chrono::steady_clock::now();
+	for (::size_t off = 0; off < opts.size; off += opts.block) {
+		char* chunk = pool.alloc();
+		check(::pread(fd, chunk, opts.block, off) == static_cast<::ssize_t>(opts.block), "pread");
+		pool.free(chunk);
+	}
+	std::printf("%-22s write %8.1f MB/s  read %8.1f MB/s\n", "O_DIRECT", write_mbs, mb_per_s(opts, beg));
+	::close(fd);
+}
+
+/* O_DIRECT through io_uring with registered buffers, <depth> requests in flight */
+double uring_pass(const options& opts, rapidmem::io_cache<>& pool, uring& ring, int fd, bool write) {
+	const auto beg = std::chrono::steady_clock::now();
+	::size_t off = 0, done = 0;
+	unsigned inflight = 0;
+	while (done < opts.size) {
+		while (off < opts.size && inflight < opts.depth) {
+			::io_uring_sqe* sqe = ring.get_sqe();
+			if (!sqe)
+				break;
+			char* chunk = pool.alloc();
+			if (write)
+				std::memset(chunk, 'u', opts.block);
+			sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+			sqe->fd = fd;
+			sqe->off = off;
+			sqe->addr = reinterpret_cast<::uintptr_t>(chunk);
+			sqe->len = opts.block;
+			sqe->buf_index = pool.storage().buffer_index(chunk);
+			sqe->user_data = pool.storage().index(chunk);
+			off += opts.block;
+			++inflight;
+		}
+		check(ring.submit(1) >= 0, "io_uring_enter");
+		::io_uring_cqe cqe;
+		while (ring.peek(cqe)) {
+			if (cqe.res != static_cast<int>(opts.block)) {
+				errno = cqe.res < 0 ? -cqe.res : EIO;
+				check(false, write ? "IORING_OP_WRITE_FIXED" : "IORING_OP_READ_FIXED");
+			}
+			pool.free(pool.storage().chunk(cqe.user_data));
+			done += opts.block;
+			--inflight;
+		}
+	}
+	return mb_per_s(opts, beg);
+}
+
+void bench_uring(const options& opts, rapidmem::io_cache<>& pool) {
+	uring ring(opts.depth);
+	if (!ring) {
+		std::printf("%-22s not available\n", "io_uring fixed");
+		return;
+	}
+	pool.storage().pin();
+	check(ring.register_buffers(pool.storage().regions()), "IORING_REGISTER_BUFFERS");
+
+	int fd = ::open(opts.path, O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	check(fd >= 0, opts.path);
+	const double write_mbs = uring_pass(opts, pool, ring, fd, true);
+	const double read_mbs = uring_pass(opts, pool, ring, fd, false);
+	char name[32];
+	std::snprintf(name, sizeof(name), "io_uring fixed, QD %u", opts.depth);
+	std::printf("%-22s write %8.1f MB/s  read %8.1f MB/s\n", name, write_mbs, read_mbs);
+	::close(fd);
+}
+
+} /* anonymous namespace */
+
+int
+main(int argc, char** argv) {
+	options opts;
+	if (argc > 1) opts.path = argv[1];
+	if (argc > 2) opts.size = std::strtoull(argv[2], nullptr, 0) << 20;
+	if (argc > 3) opts.block = std::strtoull(argv[3], nullptr, 0) << 10;
+	if (argc > 4) opts.depth = std::strtoul(argv[4], nullptr, 0);
+	if (argc > 5 || !opts.size || !opts.block || !opts.depth || opts.block % ::sysconf(_SC_PAGESIZE) || opts.size % opts.block) {
+		std::fprintf(stderr, "Usage: io_bench [file [MB [block KB [queue depth]]]]\n");
+		return 1;
+	}
+
+	rapidmem::io_cache<> pool{opts.block, opts.depth, rapidmem::region_storage<char>{opts.block, 4 * opts.depth}};
+	pool.upkeep();
+
+	bench_buffered(opts);
+	bench_direct(opts, pool);
+	bench_uring(opts, pool);
+	::unlink(opts.path);
+	return 0;
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "cache.hpp"
+
+namespace rapidmem {
+
+/* Storage of page-aligned chunks carved from one mapping created in advance.
+ * The mapping is split into regions of at most 1 GB (the limit of one
+ * io_uring registered buffer), see regions(). Chunk numbers and buffer
+ * indexes of a chunk never change, so the regions can be registered with
+ * io_uring once and chunks used with IORING_OP_READ_FIXED/WRITE_FIXED,
+ * or with O_DIRECT files. */
+template <typename T>
+class region_storage {
+	static_assert(std::is_trivial<T>::value && std::is_standard_layout<T>::value, "Only PODs supported");
+
+	static constexpr ::size_t max_region_bytes = 1 << 30;
+
+	::size_t chunk_size_;
+	::size_t chunk_bytes_;
+	::size_t chunks_num_;
+	::size_t region_chunks_;
+	char* base_;
+	std::vector<::uint32_t> free_;	// Numbers of chunks not handed to the cache
+	bool release_;
+
+public:
+	region_storage(const ::size_t chunk_size, const ::size_t chunks_num)
+	: chunk_size_(chunk_size)
+	, chunks_num_(chunks_num) {
+		const ::size_t page = ::sysconf(_SC_PAGESIZE);
+		chunk_bytes_ = (chunk_size_ * sizeof(T) + page - 1) / page * page;
+		assert(chunk_size_ > 0);
+		assert(chunks_num_ > 0 && chunks_num_ <= UINT32_MAX);
+		assert(chunk_bytes_ <= max_region_bytes);
+		region_chunks_ = max_region_bytes / chunk_bytes_;
+
+		void* base = ::mmap(nullptr, chunks_num_ * chunk_bytes_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base == MAP_FAILED)
+			throw std::bad_alloc();
+		base_ = static_cast<char*>(base);
+
+		free_.reserve(chunks_num_);
+		for (::size_t i = chunks_num_; i-- > 0; )
+			free_.push_back(i);
+		release_ = true;
+	}
+
+	region_storage(region_storage&& other)
+	: chunk_size_(other.chunk_size_)
+	, chunk_bytes_(other.chunk_bytes_)
+	, chunks_num_(other.chunks_num_)
+	, region_chunks_(other.region_chunks_)
+	, base_(other.base_)
+	, free_(std::move(other.free_))
+	, release_(other.release_) {
+		other.base_ = nullptr;
+	}
+
+	region_storage(const region_storage&) = delete;
+	region_storage& operator=(const region_storage&) = delete;
+
+	~region_storage() {
+		if (base_)
+			::munmap(base_, chunks_num_ * chunk_bytes_);
+	}
+
+	T* allocate(const ::size_t chunk_size) {
+		assert(chunk_size == chunk_size_);
+		if (free_.empty())
+			return nullptr;
+		const ::uint32_t i = free_.back();
+		free_.pop_back();
+		return reinterpret_cast<T*>(base_ + i * chunk_bytes_);
+	}
+
+	/* The chunk stays mapped, its pages are returned to the OS by madvise(MADV_DONTNEED) */
+	void deallocate(T* chunk, const ::size_t chunk_size) {
+		assert(chunk_size == chunk_size_);
+		if (release_)
+			::madvise(chunk, chunk_bytes_, MADV_DONTNEED);
+		free_.push_back(index(chunk));
+	}
+
+	/* Stop returning pages of deallocated chunks to the OS. This has to be called
+	 * when the regions are registered with io_uring: the kernel keeps the pinned
+	 * pages, so after madvise() the process and io_uring would use different memory. */
+	void pin() {
+		release_ = false;
+	}
+
+	/* Stable number of a chunk in the interval [0, chunks_num) */
+	::size_t index(const T* chunk) const {
+		const ::size_t offset = reinterpret_cast<const char*>(chunk) - base_;
+		assert(offset < chunks_num_ * chunk_bytes_ && offset % chunk_bytes_ == 0);
+		return offset / chunk_bytes_;
+	}
+
+	/* Index of the registered buffer (the region) containing a chunk, see regions() */
+	::size_t buffer_index(const T* chunk) const {
+		return index(chunk) / region_chunks_;
+	}
+
+	T* chunk(const ::size_t index) const {
+		return reinterpret_cast<T*>(base_ + index * chunk_bytes_);
+	}
+
+	/* Chunk size rounded up to whole pages */
+	::size_t chunk_bytes() const {
+		return chunk_bytes_;
+	}
+
+	::size_t chunks_num() const {
+		return chunks_num_;
+	}
+
+	/* Regions to be registered with io_uring_register(IORING_REGISTER_BUFFERS), in the order of buffer indexes */
+	std::vector<::iovec> regions() const {
+		std::vector<::iovec> iov;
+		for (::size_t i = 0; i < chunks_num_; i += region_chunks_) {
+			const ::size_t n = std::min(region_chunks_, chunks_num_ - i);
+			iov.push_back(::iovec{base_ + i * chunk_bytes_, n * chunk_bytes_});
+		}
+		return iov;
+	}
+};
+
+/* Cache of page-aligned I/O buffers. The number of chunks is limited by the storage:
+ *
+ *	rapidmem::io_cache<> pool{4096, 64, rapidmem::region_storage<char>{4096, 1024}};
+ */
+template <typename T = char, unsigned M = 4>
+using io_cache = cache<T, M, region_storage<T>>;
+
+} /* namespace rapidmem */
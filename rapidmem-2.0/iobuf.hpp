@@ -0,0 +1,276 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include <sys/uio.h>
+
+#include "cache.hpp"
+
+namespace rapidmem {
+
+/* Byte buffer made of a chain of chunks of a rapidmem cache. Chunks are shared
+ * between buffers by reference counting, so appending another buffer, splitting,
+ * slicing and cloning do not copy any data. A chunk is returned to the cache when
+ * the last buffer referencing it releases it.
+ *
+ * The reference count lives at the end of each chunk, so the data start at the
+ * beginning of the chunk and keep its alignment. A buffer is not thread-safe,
+ * but buffers sharing chunks may be used by different threads. */
+template <typename Cache>
+class iobuf {
+	typedef typename Cache::value_type T;
+
+	struct segment {
+		T* chunk;
+		char* data;
+		::size_t len;
+	};
+
+	Cache* cache_;
+	std::vector<segment> segs_;
+	::size_t size_;
+	::size_t prepared_;	// The first segment returned by prepare()
+
+	::size_t capacity() const {
+		return (cache_->chunk_size() * sizeof(T) - sizeof(std::atomic<::uint32_t>)) / alignof(std::atomic<::uint32_t>) * alignof(std::atomic<::uint32_t>);
+	}
+
+	std::atomic<::uint32_t>& refs(T* chunk) const {
+		return *reinterpret_cast<std::atomic<::uint32_t>*>(reinterpret_cast<char*>(chunk) + capacity());
+	}
+
+	void ref(T* chunk) const {
+		refs(chunk).fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void unref(T* chunk) const {
+		if (refs(chunk).fetch_sub(1, std::memory_order_acq_rel) == 1)
+			cache_->free(chunk);
+	}
+
+	segment new_segment() const {
+		T* chunk = cache_->alloc();
+		new (&refs(chunk)) std::atomic<::uint32_t>(1);
+		return segment{chunk, reinterpret_cast<char*>(chunk), 0};
+	}
+
+	::size_t tail(const segment& seg) const {
+		return reinterpret_cast<char*>(seg.chunk) + capacity() - (seg.data + seg.len);
+	}
+
+	/* Free space behind the segment, available only if no other segment references the chunk */
+	::size_t room(const segment& seg) const {
+		return refs(seg.chunk).load(std::memory_order_acquire) == 1 ? tail(seg) : 0;
+	}
+
+	/* Empty segments at the end are created by prepare() */
+	void trim() {
+		while (!segs_.empty() && !segs_.back().len) {
+			unref(segs_.back().chunk);
+			segs_.pop_back();
+		}
+	}
+
+	/* Index of the first segment with data behind the first <off> bytes and the offset inside it */
+	std::pair<::size_t, ::size_t> locate(::size_t off) const {
+		::size_t i = 0;
+		while (i < segs_.size() && off >= segs_[i].len && segs_[i].len) {
+			off -= segs_[i].len;
+			++i;
+		}
+		return std::make_pair(i, off);
+	}
+
+public:
+	explicit iobuf(Cache& cache)
+	: cache_(&cache)
+	, size_(0)
+	, prepared_(0) {
+		assert(cache.chunk_size() * sizeof(T) > sizeof(std::atomic<::uint32_t>));
+	}
+
+	iobuf(const iobuf& other)
+	: cache_(other.cache_)
+	, size_(other.size_)
+	, prepared_(0) {
+		for (const segment& seg : other.segs_) {
+			if (!seg.len)
+				break;
+			ref(seg.chunk);
+			segs_.push_back(seg);
+		}
+	}
+
+	iobuf(iobuf&& other)
+	: cache_(other.cache_)
+	, segs_(std::move(other.segs_))
+	, size_(other.size_)
+	, prepared_(other.prepared_) {
+		other.segs_.clear();
+		other.size_ = 0;
+	}
+
+	iobuf& operator=(iobuf other) {
+		std::swap(cache_, other.cache_);
+		std::swap(segs_, other.segs_);
+		std::swap(size_, other.size_);
+		std::swap(prepared_, other.prepared_);
+		return *this;
+	}
+
+	~iobuf() {
+		clear();
+	}
+
+	::size_t size() const {
+		return size_;
+	}
+
+	bool empty() const {
+		return !size_;
+	}
+
+	void clear() {
+		for (const segment& seg : segs_)
+			unref(seg.chunk);
+		segs_.clear();
+		size_ = 0;
+	}
+
+	/* Buffer sharing all chunks with this one */
+	iobuf clone() const {
+		return iobuf(*this);
+	}
+
+	/* Copy <len> bytes to the end of the buffer. This is the only operation that copies data. */
+	void append(const void* data, ::size_t len) {
+		const char* p = static_cast<const char*>(data);
+		trim();
+		while (len) {
+			if (segs_.empty() || !room(segs_.back()))
+				segs_.push_back(new_segment());
+			segment& seg = segs_.back();
+			const ::size_t n = std::min(len, room(seg));
+			std::memcpy(seg.data + seg.len, p, n);
+			seg.len += n;
+			size_ += n;
+			p += n;
+			len -= n;
+		}
+	}
+
+	/* Append data of another buffer, sharing its chunks */
+	void append(const iobuf& other) {
+		append(iobuf(other));
+	}
+
+	/* Append data of another buffer, taking over its chunks */
+	void append(iobuf&& other) {
+		assert(cache_ == other.cache_);
+		trim();
+		other.trim();
+		segs_.insert(segs_.end(), other.segs_.begin(), other.segs_.end());
+		size_ += other.size_;
+		other.segs_.clear();
+		other.size_ = 0;
+	}
+
+	/* Buffer referencing <len> bytes starting at <off> */
+	iobuf slice(::size_t off, ::size_t len) const {
+		assert(off + len <= size_);
+		iobuf res(*cache_);
+		auto pos = locate(off);
+		for (::size_t i = pos.first; len; ++i) {
+			const segment& seg = segs_[i];
+			const ::size_t n = std::min(len, seg.len - pos.second);
+			ref(seg.chunk);
+			res.segs_.push_back(segment{seg.chunk, seg.data + pos.second, n});
+			res.size_ += n;
+			len -= n;
+			pos.second = 0;
+		}
+		return res;
+	}
+
+	/* Remove the first <n> bytes and return them as a new buffer */
+	iobuf split(::size_t n) {
+		assert(n <= size_);
+		iobuf res(*cache_);
+		auto pos = locate(n);
+		res.segs_.assign(segs_.begin(), segs_.begin() + pos.first);
+		res.size_ = n;
+		segs_.erase(segs_.begin(), segs_.begin() + pos.first);
+		if (pos.second) {
+			// The chunk in the middle is shared by both halves
+			segment& seg = segs_.front();
+			ref(seg.chunk);
+			res.segs_.push_back(segment{seg.chunk, seg.data, pos.second});
+			seg.data += pos.second;
+			seg.len -= pos.second;
+		}
+		size_ -= n;
+		return res;
+	}
+
+	/* Drop the first <n> bytes, e.g. after they were written by writev() */
+	void consume(::size_t n) {
+		split(n);
+	}
+
+	/* Fill at most <max> entries of <iov> with the data, return the number of entries used */
+	::size_t iovecs(::iovec* iov, ::size_t max) const {
+		::size_t n = 0;
+		for (const segment& seg : segs_) {
+			if (n == max || !seg.len)
+				break;
+			iov[n++] = ::iovec{seg.data, seg.len};
+		}
+		return n;
+	}
+
+	/* Make sure there is room for at least <len> bytes at the end of the buffer and fill at most
+	 * <max> entries of <iov> with the room, e.g. for readv(). Return the number of entries used.
+	 * Data written there become part of the buffer by commit(), the buffer must not be
+	 * modified or copied in between. */
+	::size_t prepare(::size_t len, ::iovec* iov, ::size_t max) {
+		::size_t i = segs_.size();
+		while (i > 0 && !segs_[i-1].len)
+			--i;
+		if (i > 0 && room(segs_[i-1]))
+			--i;
+		prepared_ = i;
+		::size_t n = 0, avail = 0;
+		for (;; ++i) {
+			if (n == max || (avail >= len && n))
+				break;
+			if (i == segs_.size())
+				segs_.push_back(new_segment());
+			const segment& seg = segs_[i];
+			const ::size_t r = room(seg);
+			iov[n++] = ::iovec{seg.data + seg.len, r};
+			avail += r;
+		}
+		return n;
+	}
+
+	/* Add <len> bytes written to the room returned by prepare() */
+	void commit(::size_t len) {
+		size_ += len;
+		for (::size_t i = prepared_; len; ++i) {
+			segment& seg = segs_[i];
+			const ::size_t n = std::min(len, tail(seg));
+			seg.len += n;
+			len -= n;
+		}
+		trim();
+	}
+};
+
+} /* namespace rapidmem */
@@ -0,0 +1,228 @@
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "iobuf.hpp"
+
+/* Random operations on buffers sharing small chunks, every buffer is checked
+ * against a string holding its expected contents. A write to a chunk shared
+ * with another buffer shows up as a mismatch in that buffer, a missed
+ * reference as a chunk not returned to the cache at the end. */
+
+namespace {
+
+/* Cache counting chunks held outside of it */
+class counting_cache : public rapidmem::cache<char> {
+	std::atomic<long> out_{0};
+
+public:
+	using rapidmem::cache<char>::cache;
+
+	char* alloc() {
+		out_.fetch_add(1, std::memory_order_relaxed);
+		return rapidmem::cache<char>::alloc();
+	}
+
+	void free(char* chunk) {
+		out_.fetch_sub(1, std::memory_order_relaxed);
+		rapidmem::cache<char>::free(chunk);
+	}
+
+	long out() const {
+		return out_.load(std::memory_order_relaxed);
+	}
+};
+
+typedef rapidmem::iobuf<counting_cache> iobuf;
+
+constexpr ::size_t chunk_size = 64;	// Small chunks make every operation cross chunk boundaries
+
+counting_cache cache{chunk_size, 4096};
+unsigned errors = 0;
+unsigned random_state = 1;
+
+unsigned next_random(const unsigned n) {
+	random_state = random_state * 1103515245 + 12345;
+	return (random_state >> 8) % n;
+}
+
+std::string contents(const iobuf& buf) {
+	std::vector<::iovec> iov(buf.size() + 1);
+	const ::size_t n = buf.iovecs(iov.data(), iov.size());
+	std::string s;
+	for (::size_t i = 0; i < n; ++i)
+		s.append(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+	return s;
+}
+
+void check(const iobuf& buf, const std::string& expected, const char* op) {
+	if (buf.size() != expected.size() || contents(buf) != expected) {
+		if (errors++ < 10)
+			std::fprintf(stderr, "%s: %zu bytes, expected %zu\n", op, buf.size(), expected.size());
+	}
+}
+
+std::string random_bytes(const ::size_t len) {
+	std::string s(len, 0);
+	for (char& c : s)
+		c = 'a' + next_random(26);
+	return s;
+}
+
+/* Fill the room returned by prepare() and commit a part of it, as readv() would */
+void read_into(iobuf& buf, std::string& expected, const ::size_t want, const ::size_t got) {
+	::iovec iov[8];
+	const ::size_t n = buf.prepare(want, iov, 8);
+	const std::string data = random_bytes(got);
+	::size_t done = 0;
+	for (::size_t i = 0; i < n && done < got; ++i) {
+		const ::size_t k = std::min(got - done, iov[i].iov_len);
+		std::memcpy(iov[i].iov_base, data.data() + done, k);
+		done += k;
+	}
+	buf.commit(done);
+	expected += data.substr(0, done);
+}
+
+void random_ops(const unsigned rounds) {
+	std::vector<iobuf> bufs;
+	std::vector<std::string> expected;
+	for (unsigned i = 0; i < 16; ++i) {
+		bufs.emplace_back(cache);
+		expected.emplace_back();
+	}
+	for (unsigned r = 0; r < rounds; ++r) {
+		const unsigned a = next_random(bufs.size());
+		const unsigned b = (a + 1 + next_random(bufs.size() - 1)) % bufs.size();	// Another buffer
+		iobuf& x = bufs[a];
+		std::string& ex = expected[a];
+		switch (next_random(9)) {
+		case 0: {
+			const std::string s = random_bytes(next_random(200));
+			x.append(s.data(), s.size());
+			ex += s;
+			check(x, ex, "append bytes");
+			break;
+		}
+		case 1:
+			x.append(bufs[b]);
+			ex += expected[b];
+			check(x, ex, "append");
+			check(bufs[b], expected[b], "append source");
+			if (!next_random(4)) {
+				x.append(x);
+				ex += ex;
+				check(x, ex, "append itself");
+			}
+			break;
+		case 2:
+			x.append(std::move(bufs[b]));
+			ex += expected[b];
+			expected[b].clear();
+			check(x, ex, "append moved");
+			check(bufs[b], expected[b], "append moved source");
+			break;
+		case 3: {
+			const ::size_t n = next_random(ex.size() + 1);
+			bufs[b] = x.split(n);
+			expected[b] = ex.substr(0, n);
+			ex.erase(0, n);
+			check(bufs[b], expected[b], "split head");
+			check(bufs[a], expected[a], "split rest");
+			break;
+		}
+		case 4: {
+			const ::size_t off = next_random(ex.size() + 1), len = next_random(ex.size() - off + 1);
+			iobuf s = x.slice(off, len);
+			const std::string es = ex.substr(off, len);
+			check(s, es, "slice");
+			bufs[b] = std::move(s);
+			expected[b] = es;
+			break;
+		}
+		case 5:
+			bufs[b] = x.clone();
+			expected[b] = expected[a];
+			check(bufs[b], expected[b], "clone");
+			break;
+		case 6: {
+			const ::size_t n = next_random(ex.size() + 1);
+			x.consume(n);
+			ex.erase(0, n);
+			check(x, ex, "consume");
+			break;
+		}
+		case 7: {
+			const ::size_t want = 1 + next_random(300);
+			read_into(x, ex, want, next_random(want + 1));
+			check(x, ex, "prepare/commit");
+			break;
+		}
+		case 8:
+			if (!next_random(8)) {
+				x.clear();
+				ex.clear();
+				check(x, ex, "clear");
+			}
+			break;
+		}
+	}
+	for (unsigned i = 0; i < bufs.size(); ++i)
+		check(bufs[i], expected[i], "final");
+}
+
+/* Data read by readv() into prepared room and written out by writev() */
+void pipe_roundtrip() {
+	int fds[2];
+	if (::pipe(fds)) {
+		std::perror("pipe");
+		++errors;
+		return;
+	}
+	const std::string data = random_bytes(4000);
+	iobuf in{cache}, out{cache};
+	out.append(data.data(), data.size());
+	while (!out.empty()) {
+		::iovec iov[16];
+		const ::ssize_t n = ::writev(fds[1], iov, out.iovecs(iov, 16));
+		if (n < 0) {
+			std::perror("writev");
+			++errors;
+			break;
+		}
+		out.consume(n);
+	}
+	::close(fds[1]);
+	for (;;) {
+		::iovec iov[16];
+		const ::ssize_t n = ::readv(fds[0], iov, in.prepare(1000, iov, 16));
+		if (n <= 0) {
+			if (n < 0) {
+				std::perror("readv");
+				++errors;
+			}
+			in.commit(0);
+			break;
+		}
+		in.commit(n);
+	}
+	::close(fds[0]);
+	check(in, data, "pipe");
+}
+
+} /* anonymous namespace */
+
+int
+main(void) {
+	cache.inline_upkeep(64);	// Self-appends can make the buffers big
+	cache.upkeep();
+	random_ops(200000);
+	pipe_roundtrip();
+	const long leaked = cache.out();
+	std::printf("%u errors, %ld chunks not returned\n", errors, leaked);
+	return errors || leaked;
+}
@@ -0,0 +1,162 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "cache.hpp"
+#include "seq_ring.hpp"
+#include "stack.hpp"
+
+/* Order of chunk reuse: every thread allocates a few chunks, writes one word
+ * of every cache line of them (a touch) and frees them. The FIFO engines hand
+ * out the chunk freed longest ago, the stack the one freed last. Cache and
+ * dTLB misses per touch are read from perf_event_open() counters of the
+ * process; where they are not available (e.g. in a VM or with
+ * kernel.perf_event_paranoid > 2) only the time is reported. */
+
+namespace {
+
+struct options {
+	unsigned threads = 1;
+	unsigned seconds = 2;
+	::size_t chunk_size = 16384;
+	::size_t chunks = 1024;	// Minimal number of chunks of the cache, the cache holds 4 times more
+	unsigned batch = 4;
+};
+
+class counter {
+	int fd_;
+
+public:
+	counter(const ::uint32_t type, const ::uint64_t config) {
+		::perf_event_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.disabled = 1;
+		attr.inherit = 1;	// Count the worker threads too
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd_ = ::syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+
+	counter(const counter&) = delete;
+	counter& operator=(const counter&) = delete;
+
+	~counter() {
+		if (fd_ >= 0)
+			::close(fd_);
+	}
+
+	explicit operator bool() const {
+		return fd_ >= 0;
+	}
+
+	void start() {
+		if (fd_ >= 0) {
+			::ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+			::ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+
+	::uint64_t stop() {
+		::uint64_t value = 0;
+		if (fd_ >= 0) {
+			::ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+			if (::read(fd_, &value, sizeof(value)) != sizeof(value))
+				value = 0;
+		}
+		return value;
+	}
+};
+
+template <template <typename> class Queue>
+void bench(const char* name, const options& opts) {
+	rapidmem::cache<char, 4, rapidmem::heap_storage<char>, Queue> cache{opts.chunk_size, opts.chunks};
+	cache.upkeep();
+	// Touch all chunks once, so the first round does not measure page faults
+	std::vector<char*> all;
+	while (char* chunk = cache.try_alloc()) {
+		std::memset(chunk, 0, opts.chunk_size);
+		all.push_back(chunk);
+	}
+	for (char* chunk : all)
+		cache.free(chunk);
+
+	counter misses{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES};
+	counter tlb_misses{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_WRITE << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16};
+
+	std::atomic<bool> run{true};
+	std::vector<::uint64_t> touches(opts.threads);
+	std::vector<std::thread> workers;
+	misses.start();
+	tlb_misses.start();
+	const auto beg = std::chrono::steady_clock::now();
+	for (unsigned t = 0; t < opts.threads; ++t) {
+		workers.emplace_back([&, t] {
+			std::vector<char*> chunks(opts.batch);
+			::uint64_t n = 0;
+			while (run.load(std::memory_order_relaxed)) {
+				for (char*& chunk : chunks) {
+					chunk = cache.alloc();
+					for (::size_t i = 0; i < opts.chunk_size; i += 64)
+						chunk[i]++;
+					n += opts.chunk_size / 64;
+				}
+				for (char* chunk : chunks)
+					cache.free(chunk);
+			}
+			touches[t] = n;
+		});
+	}
+	std::this_thread::sleep_for(std::chrono::seconds(opts.seconds));
+	run.store(false);
+	for (std::thread& worker : workers)
+		worker.join();
+	const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - beg).count();
+	const ::uint64_t cache_misses = misses.stop();
+	const ::uint64_t dtlb_misses = tlb_misses.stop();
+
+	::uint64_t total = 0;
+	for (::uint64_t n : touches)
+		total += n;
+	std::printf("%-10s %8.2f ns/touch", name, elapsed * 1e9 * opts.threads / total);
+	if (misses)
+		std::printf("  %6.3f cache misses/touch", static_cast<double>(cache_misses) / total);
+	else
+		std::printf("  cache misses n/a");
+	if (tlb_misses)
+		std::printf("  %6.4f dTLB misses/touch", static_cast<double>(dtlb_misses) / total);
+	else
+		std::printf("  dTLB misses n/a");
+	std::printf("\n");
+}
+
+} /* anonymous namespace */
+
+int
+main(int argc, char** argv) {
+	options opts;
+	if (argc > 1) opts.threads = std::strtoul(argv[1], nullptr, 0);
+	if (argc > 2) opts.seconds = std::strtoul(argv[2], nullptr, 0);
+	if (argc > 3) opts.chunk_size = std::strtoul(argv[3], nullptr, 0);
+	if (argc > 4) opts.chunks = std::strtoul(argv[4], nullptr, 0);
+	if (argc > 5 || !opts.threads || !opts.seconds || !opts.chunk_size || !opts.chunks) {
+		std::fprintf(stderr, "Usage: lifo_bench [threads [seconds [chunk size [chunks]]]]\n");
+		return 1;
+	}
+
+	bench<rapidmem::ring>("ring", opts);
+	bench<rapidmem::seq_ring>("seq_ring", opts);
+	bench<rapidmem::stack>("stack", opts);
+	return 0;
+}
@@ -2,6 +2,7 @@
 #include <array>
 #include <chrono>
 #include <random>
+#include <string>
 #include <thread>
 
 #include "cache.hpp"
@@ -48,13 +49,20 @@ void upkeep() {
 
 } /* anonymous namespoace */
 
+/* With an argument "inline", the cache is kept by alloc() and free() (see cache::inline_upkeep()) instead of an upkeep thread */
 int
-main(void) {
+main(int argc, char** argv) {
+	const bool inline_upkeep = argc > 1 && std::string(argv[1]) == "inline";
+	if (inline_upkeep)
+		cache.inline_upkeep(64);
 	std::array<std::thread, 12> thes;
 	for(auto &the: thes) { the = std::thread{test, rand()}; }
-	std::thread the_upkeep{upkeep};
+	std::thread the_upkeep;
+	if (!inline_upkeep)
+		the_upkeep = std::thread{upkeep};
 	for(auto &the: thes) { the.join(); }
 	upkeep_run.store(false);
-	the_upkeep.join();
+	if (the_upkeep.joinable())
+		the_upkeep.join();
 	return 0;
 }
@@ -0,0 +1,111 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+namespace {
+
+/* Every preempt_period-th claimed slot, the thread sleeps as if it was preempted
+ * between claiming the slot and filling or clearing it */
+unsigned preempt_period = 0;
+std::chrono::microseconds preempt_time{200};
+
+void preempt_hook() {
+	thread_local unsigned n = 0;
+	if (preempt_period && ++n % preempt_period == 0)
+		std::this_thread::sleep_for(preempt_time);
+}
+
+} /* anonymous namespace */
+
+#define RAPIDMEM_PREEMPT_HOOK() preempt_hook()
+
+#include "cache.hpp"
+#include "seq_ring.hpp"
+
+namespace {
+
+struct options {
+	unsigned threads = 8;
+	unsigned seconds = 2;
+	unsigned batch = 8;
+};
+
+struct result {
+	::uint64_t ops = 0;
+	std::vector<double> latencies;	// Microseconds of alloc+free of one batch
+};
+
+template <template <typename> class Queue>
+void bench(const char* name, const options& opts) {
+	rapidmem::cache<char, 4, rapidmem::heap_storage<char>, Queue> cache{64, 1024};
+	cache.upkeep();
+
+	std::atomic<bool> run{true};
+	std::thread upkeep([&] {
+		while (run.load(std::memory_order_relaxed)) {
+			cache.upkeep();
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	});
+
+	std::vector<result> results(opts.threads);
+	std::vector<std::thread> workers;
+	for (unsigned t = 0; t < opts.threads; ++t) {
+		workers.emplace_back([&, t] {
+			result& res = results[t];
+			std::vector<char*> chunks(opts.batch);
+			while (run.load(std::memory_order_relaxed)) {
+				const auto beg = std::chrono::steady_clock::now();
+				for (char*& chunk : chunks)
+					chunk = cache.alloc();
+				for (char* chunk : chunks)
+					cache.free(chunk);
+				res.latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - beg).count());
+				res.ops += 2 * opts.batch;
+			}
+		});
+	}
+	std::this_thread::sleep_for(std::chrono::seconds(opts.seconds));
+	run.store(false);
+	for (std::thread& worker : workers)
+		worker.join();
+	upkeep.join();
+
+	::uint64_t ops = 0;
+	std::vector<double> lat;
+	for (const result& res : results) {
+		ops += res.ops;
+		lat.insert(lat.end(), res.latencies.begin(), res.latencies.end());
+	}
+	std::sort(lat.begin(), lat.end());
+	auto pct = [&](double p) { return lat.empty() ? 0 : lat[std::min(lat.size() - 1, static_cast<::size_t>(p * lat.size()))]; };
+	std::printf("%-10s %-14s %8.2f Mops/s  p50 %8.1f us  p99 %8.1f us  p99.9 %9.1f us  max %9.1f us\n",
+		name, preempt_period ? "preempted" : "not preempted", ops / 1e6 / opts.seconds,
+		pct(0.5), pct(0.99), pct(0.999), lat.empty() ? 0 : lat.back());
+}
+
+} /* anonymous namespace */
+
+int
+main(int argc, char** argv) {
+	options opts;
+	if (argc > 1) opts.threads = std::strtoul(argv[1], nullptr, 0);
+	if (argc > 2) opts.seconds = std::strtoul(argv[2], nullptr, 0);
+	if (argc > 3) preempt_period = std::strtoul(argv[3], nullptr, 0);
+	if (argc > 4 || !opts.threads || !opts.seconds) {
+		std::fprintf(stderr, "Usage: ring_bench [threads [seconds [preempt period]]]\n");
+		return 1;
+	}
+
+	const unsigned period = preempt_period ? preempt_period : 4096;
+	for (unsigned preempt : {0u, period}) {
+		preempt_period = preempt;
+		bench<rapidmem::ring>("ring", opts);
+		bench<rapidmem::seq_ring>("seq_ring", opts);
+	}
+	return 0;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "cache.hpp"
+
+namespace rapidmem {
+
+/* Bounded MPMC queue of chunks with per-slot sequence numbers (D. Vyukov's
+ * algorithm), an alternative engine of the cache:
+ *
+ *	rapidmem::cache<char, 4, rapidmem::heap_storage<char>, rapidmem::seq_ring> cache{4096, 1024};
+ *
+ * A slot at position pos is free for a producer if its sequence number is pos
+ * and holds a chunk for a consumer if it is pos + 1, so threads claim positions
+ * by one CAS and nobody waits for a slot another thread has claimed but not
+ * filled or cleared yet. A thread preempted in between still makes the queue
+ * look empty (full) at its position to consumers (producers) until it resumes:
+ * try_get() and try_put() fail instead of scanning over the hole. */
+template <typename T>
+class seq_ring {
+	struct slot {
+		std::atomic<::uint64_t> seq;
+		T* chunk;
+	};
+
+	::size_t size_;
+	std::unique_ptr<slot[]> slots_;
+	alignas(64) std::atomic<::uint64_t> beg_;
+	alignas(64) std::atomic<::uint64_t> end_;
+
+public:
+	explicit seq_ring(const ::size_t size)
+	: size_(size)
+	, slots_(new slot[size_])
+	, beg_(0)
+	, end_(0) {
+		for (::size_t i = 0; i < size_; ++i) {
+			slots_[i].seq.store(i, std::memory_order_relaxed);
+			slots_[i].chunk = nullptr;
+		}
+	}
+
+	/* Approximate number of chunks in the queue */
+	::size_t size() const {
+		const ::uint64_t beg = beg_.load(std::memory_order_relaxed);
+		const ::uint64_t end = end_.load(std::memory_order_relaxed);
+		return end > beg ? end - beg : 0;
+	}
+
+	/* Returns nullptr if there is no chunk in the queue */
+	T* try_get() {
+		::uint64_t pos = beg_.load(std::memory_order_relaxed);
+		for (;;) {
+			slot& s = slots_[pos % size_];
+			const ::int64_t diff = static_cast<::int64_t>(s.seq.load(std::memory_order_acquire) - (pos + 1));
+			if (diff == 0) {
+				if (beg_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			} else if (diff < 0) {
+				return nullptr;
+			} else {
+				pos = beg_.load(std::memory_order_relaxed);
+			}
+		}
+		slot& s = slots_[pos % size_];
+		RAPIDMEM_PREEMPT_HOOK();
+		T* chunk = s.chunk;
+		s.seq.store(pos + size_, std::memory_order_release);
+		return chunk;
+	}
+
+	/* Returns false if the queue is full */
+	bool try_put(T* chunk) {
+		::uint64_t pos = end_.load(std::memory_order_relaxed);
+		for (;;) {
+			slot& s = slots_[pos % size_];
+			const ::int64_t diff = static_cast<::int64_t>(s.seq.load(std::memory_order_acquire) - pos);
+			if (diff == 0) {
+				if (end_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = end_.load(std::memory_order_relaxed);
+			}
+		}
+		slot& s = slots_[pos % size_];
+		RAPIDMEM_PREEMPT_HOOK();
+		s.chunk = chunk;
+		s.seq.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+};
+
+} /* namespace rapidmem */
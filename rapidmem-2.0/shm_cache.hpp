@@ -0,0 +1,339 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <system_error>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.hpp"
+
+namespace rapidmem {
+
+/* Cache of chunks shared by cooperating processes. The queue, the chunks and the
+ * table of chunk owners live in one shared memory segment (memfd or shm_open),
+ * which each process maps at its own address, so chunks are addressed by their
+ * offset in the segment. A chunk allocated in one process can be passed to
+ * another one by its offset and freed there, without copying the data.
+ *
+ * All chunks are carved from the segment when it is created, there is no
+ * upkeep(). The queue is rapidmem::ring_algorithm over offsets, so
+ * alloc() and free() are non-blocking in the same sense as in the cache, and a
+ * process dying in the middle of them leaves only a hole the others skip.
+ * Every chunk records the pid and the start time of the process holding it, and
+ * chunks held by a dead process are returned by recover(); the start time tells
+ * a new process reusing the pid from the dead owner. A process receiving a chunk from
+ * another one takes it over by adopt(). A chunk is lost if a process dies just
+ * between taking it from the queue and recording itself as its owner, or
+ * between clearing the owner and putting it back in free().
+ *
+ *	rapidmem::shm_cache<char> cache{4096, 1024};	// memfd, pass cache.fd() to other processes
+ *	rapidmem::shm_cache<char> other{fd};		// attach in another process
+ */
+template <typename T>
+class shm_cache {
+	static_assert(std::is_trivial<T>::value && std::is_standard_layout<T>::value, "Only PODs supported");
+	static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "Atomics in shared memory have to be lock-free");
+
+	static constexpr ::uint64_t magic = 0x3230686d6d646172ULL;	// "radmmh02"
+
+	struct header {
+		::uint64_t magic;
+		::uint64_t chunk_size;
+		::uint64_t chunk_bytes;
+		::uint64_t chunks_num;
+		::uint64_t queue_size;
+		::uint64_t chunks_off;
+		::uint64_t segment_size;
+		alignas(64) std::atomic<::uint64_t> beg;
+		alignas(64) std::atomic<::uint64_t> end;
+	};
+
+	int fd_;
+	char* base_;
+	::size_t segment_size_;
+	std::atomic<::uint64_t> self_;	// Owner value of this process, see owner_of()
+
+	header& hdr() const {
+		return *reinterpret_cast<header*>(base_);
+	}
+
+	/* Slots of the queue hold offsets of chunks, 0 is an empty slot */
+	std::atomic<::uint64_t>* slots() const {
+		return reinterpret_cast<std::atomic<::uint64_t>*>(base_ + sizeof(header));
+	}
+
+	/* Owner of each chunk (see owner_of()), 0 for chunks in the queue */
+	std::atomic<::uint64_t>* owners() const {
+		return reinterpret_cast<std::atomic<::uint64_t>*>(slots() + hdr().queue_size);
+	}
+
+	/* Start time of a process in clock ticks since boot (field 22 of /proc/<pid>/stat), 0 if it cannot be read */
+	static ::uint64_t start_time(const ::pid_t pid) {
+		char buf[512];
+		std::snprintf(buf, sizeof(buf), "/proc/%d/stat", static_cast<int>(pid));
+		const int fd = ::open(buf, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return 0;
+		const ::ssize_t n = ::read(fd, buf, sizeof(buf) - 1);
+		::close(fd);
+		if (n <= 0)
+			return 0;
+		buf[n] = 0;
+		// The command name in parentheses may contain spaces, count the fields after it
+		const char* p = std::strrchr(buf, ')');
+		for (int field = 3; p && field <= 22; ++field)
+			p = std::strchr(p + 1, ' ');
+		return p ? std::strtoull(p + 1, nullptr, 10) : 0;
+	}
+
+	/* Pid in the lower half, the lower half of the start time in the upper one */
+	static ::uint64_t owner_of(const ::pid_t pid) {
+		return start_time(pid) << 32 | static_cast<::uint32_t>(pid);
+	}
+
+	static ::pid_t pid_of(const ::uint64_t owner) {
+		return static_cast<::pid_t>(owner & UINT32_MAX);
+	}
+
+	/* Owner value of the calling process, computed again in a child after fork() */
+	::uint64_t self() {
+		const ::pid_t pid = ::getpid();
+		::uint64_t owner = self_.load(std::memory_order_relaxed);
+		if (pid_of(owner) != pid) {
+			owner = owner_of(pid);
+			self_.store(owner, std::memory_order_relaxed);
+		}
+		return owner;
+	}
+
+	/* Without /proc the start time is 0 and only the pid is checked */
+	static bool alive(const ::uint64_t owner) {
+		const ::pid_t pid = pid_of(owner);
+		if (::kill(pid, 0) < 0 && errno == ESRCH)
+			return false;
+		return !(owner >> 32) || (start_time(pid) & UINT32_MAX) == owner >> 32;
+	}
+
+	/* Put chunk <i> back to the queue if it is still held by <owner> */
+	bool release(const ::size_t i, ::uint64_t owner) {
+		if (!owners()[i].compare_exchange_strong(owner, 0))
+			return false;
+		put_chunk(hdr().chunks_off + i * hdr().chunk_bytes);
+		return true;
+	}
+
+	::size_t index(const ::uint64_t off) const {
+		assert(off >= hdr().chunks_off && off < hdr().segment_size && (off - hdr().chunks_off) % hdr().chunk_bytes == 0);
+		return (off - hdr().chunks_off) / hdr().chunk_bytes;
+	}
+
+	static void check(bool ok, const char* what) {
+		if (!ok)
+			throw std::system_error(errno, std::generic_category(), what);
+	}
+
+	void map(const ::size_t size) {
+		void* base = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+		check(base != MAP_FAILED, "mmap");
+		base_ = static_cast<char*>(base);
+		segment_size_ = size;
+	}
+
+	void create(const ::size_t chunk_size, const ::size_t chunks_num) {
+		assert(chunk_size > 0);
+		assert(chunks_num > 0);
+		const ::size_t page = ::sysconf(_SC_PAGESIZE);
+		const ::size_t chunk_bytes = (chunk_size * sizeof(T) + 63) / 64 * 64;
+		// The ring needs spare slots: beg and end lag behind and dead processes may leave holes
+		const ::size_t queue_size = 2 * chunks_num;
+		const ::size_t meta = sizeof(header) + (queue_size + chunks_num) * sizeof(std::atomic<::uint64_t>);
+		const ::size_t chunks_off = (meta + page - 1) / page * page;
+		const ::size_t size = chunks_off + chunks_num * chunk_bytes;
+		check(::ftruncate(fd_, size) == 0, "ftruncate");
+		map(size);
+
+		header* h = new (base_) header;
+		h->chunk_size = chunk_size;
+		h->chunk_bytes = chunk_bytes;
+		h->chunks_num = chunks_num;
+		h->queue_size = queue_size;
+		h->chunks_off = chunks_off;
+		h->segment_size = size;
+		h->beg.store(0, std::memory_order_relaxed);
+		h->end.store(chunks_num, std::memory_order_relaxed);
+		for (::size_t i = 0; i < queue_size; ++i)
+			new (&slots()[i]) std::atomic<::uint64_t>(i < chunks_num ? chunks_off + i * chunk_bytes : 0);
+		for (::size_t i = 0; i < chunks_num; ++i)
+			new (&owners()[i]) std::atomic<::uint64_t>(0);
+		std::atomic_thread_fence(std::memory_order_release);
+		h->magic = magic;
+	}
+
+	void attach() {
+		struct ::stat st;
+		check(::fstat(fd_, &st) == 0, "fstat");
+		if (static_cast<::size_t>(st.st_size) < sizeof(header)) {
+			errno = EINVAL;
+			check(false, "shm_cache");
+		}
+		map(st.st_size);
+		if (hdr().magic != magic || hdr().segment_size != segment_size_) {
+			errno = EINVAL;
+			check(false, "shm_cache");
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+	}
+
+	/* Returns 0 if there is no chunk in the queue */
+	::uint64_t try_get_chunk() {
+		return ring_algorithm<::uint64_t>::try_get(hdr().beg, hdr().end, slots(), hdr().queue_size);
+	}
+
+	/* The queue has more slots than chunks, so it is never full for long */
+	void put_chunk(const ::uint64_t chunk) {
+		while (!ring_algorithm<::uint64_t>::try_put(hdr().beg, hdr().end, slots(), hdr().queue_size, chunk))
+			;
+	}
+
+public:
+	typedef T value_type;
+
+	/* Create a new segment in an anonymous memfd */
+	shm_cache(const ::size_t chunk_size, const ::size_t chunks_num)
+	: fd_(::memfd_create("rapidmem", MFD_CLOEXEC))
+	, self_(0) {
+		check(fd_ >= 0, "memfd_create");
+		create(chunk_size, chunks_num);
+	}
+
+	/* Create a new segment by shm_open(), it fails if <name> exists */
+	shm_cache(const char* name, const ::size_t chunk_size, const ::size_t chunks_num)
+	: fd_(::shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600))
+	, self_(0) {
+		check(fd_ >= 0, name);
+		create(chunk_size, chunks_num);
+	}
+
+	/* Attach a segment created by another process, <fd> is duplicated */
+	explicit shm_cache(const int fd)
+	: fd_(::fcntl(fd, F_DUPFD_CLOEXEC, 0))
+	, self_(0) {
+		check(fd_ >= 0, "fcntl");
+		attach();
+	}
+
+	/* Attach a segment created by shm_open() */
+	explicit shm_cache(const char* name)
+	: fd_(::shm_open(name, O_RDWR | O_CLOEXEC, 0))
+	, self_(0) {
+		check(fd_ >= 0, name);
+		attach();
+	}
+
+	shm_cache(const shm_cache&) = delete;
+	shm_cache& operator=(const shm_cache&) = delete;
+
+	~shm_cache() {
+		::munmap(base_, segment_size_);
+		::close(fd_);
+	}
+
+	/* File descriptor of the segment, e.g. to be passed by SCM_RIGHTS */
+	int fd() const {
+		return fd_;
+	}
+
+	/* Offset of a chunk, valid in every process attached to the segment */
+	::uint64_t offset(const T* chunk) const {
+		return reinterpret_cast<const char*>(chunk) - base_;
+	}
+
+	T* chunk(const ::uint64_t offset) const {
+		return reinterpret_cast<T*>(base_ + offset);
+	}
+
+	T* alloc() {
+		for (;;) {
+			T* chunk = try_alloc();
+			if (chunk)
+				return chunk;
+		}
+	}
+
+	/* Non-blocking variant of alloc(), returns nullptr if the cache is empty */
+	T* try_alloc() {
+		const ::uint64_t off = try_get_chunk();
+		if (!off)
+			return nullptr;
+		owners()[index(off)].store(self(), std::memory_order_relaxed);
+		return chunk(off);
+	}
+
+	/* The chunk may have been allocated by another process */
+	void free(T* chunk) {
+		const ::uint64_t off = offset(chunk);
+		owners()[index(off)].store(0, std::memory_order_relaxed);
+		put_chunk(off);
+	}
+
+	/* Take over a chunk passed from another process, so that it is recovered if this process dies */
+	void adopt(T* chunk) {
+		owners()[index(offset(chunk))].store(self(), std::memory_order_relaxed);
+	}
+
+	/* Return chunks held by process <pid> to the queue. It must be called only when
+	 * the process is dead. Returns the number of recovered chunks. */
+	::size_t recover(const ::pid_t pid) {
+		::size_t n = 0;
+		for (::size_t i = 0; i < hdr().chunks_num; ++i) {
+			const ::uint64_t owner = owners()[i].load(std::memory_order_relaxed);
+			if (owner && pid_of(owner) == pid)
+				n += release(i, owner);
+		}
+		return n;
+	}
+
+	/* Recover chunks of all processes that do not exist any more. A process whose
+	 * pid has been reused is recognized by its start time, unless /proc is not mounted. */
+	::size_t recover() {
+		::size_t n = 0;
+		for (::size_t i = 0; i < hdr().chunks_num; ++i) {
+			const ::uint64_t owner = owners()[i].load(std::memory_order_relaxed);
+			if (!owner || alive(owner))
+				continue;
+			for (::size_t j = i; j < hdr().chunks_num; ++j)
+				if (owners()[j].load(std::memory_order_relaxed) == owner)
+					n += release(j, owner);
+		}
+		return n;
+	}
+
+	/* Approximate number of chunks in the queue */
+	::size_t size() const {
+		const ::uint64_t beg = hdr().beg.load(std::memory_order_relaxed);
+		const ::uint64_t end = hdr().end.load(std::memory_order_relaxed);
+		return end > beg ? end - beg : 0;
+	}
+
+	::size_t chunk_size() const {
+		return hdr().chunk_size;
+	}
+
+	::size_t chunks_num() const {
+		return hdr().chunks_num;
+	}
+};
+
+} /* namespace rapidmem */
@@ -0,0 +1,121 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "shm_cache.hpp"
+
+namespace {
+
+constexpr ::size_t chunk_size = 4096;
+constexpr int producers = 4;
+constexpr int messages = 10000;
+constexpr int crasher_chunks = 10;
+
+void fail(const char* what) {
+	std::fprintf(stderr, "%s\n", what);
+	std::exit(1);
+}
+
+/* Number of chunks in the queue, it takes them out and returns them back */
+::size_t count(rapidmem::shm_cache<char>& cache) {
+	std::vector<char*> chunks;
+	while (char* chunk = cache.try_alloc())
+		chunks.push_back(chunk);
+	for (char* chunk : chunks)
+		cache.free(chunk);
+	return chunks.size();
+}
+
+/* Child process: fill chunks and pass their offsets to the parent */
+void produce(int fd, int pipe_fd, int id) {
+	rapidmem::shm_cache<char> cache{fd};
+	for (int i = 0; i < messages; ++i) {
+		char* chunk = cache.alloc();
+		std::memset(chunk, 'a' + id, chunk_size);
+		const ::uint64_t off = cache.offset(chunk);
+		if (::write(pipe_fd, &off, sizeof(off)) != sizeof(off))
+			fail("write");
+	}
+	::_exit(0);
+}
+
+/* Child process dying while it holds chunks */
+void crash(int fd) {
+	rapidmem::shm_cache<char> cache{fd};
+	for (int i = 0; i < crasher_chunks; ++i)
+		cache.alloc();
+	::_exit(1);
+}
+
+} /* anonymous namespace */
+
+int
+main(void) {
+	rapidmem::shm_cache<char> cache{chunk_size, 64};
+
+	const ::pid_t crasher = ::fork();
+	if (!crasher)
+		crash(cache.fd());
+	::waitpid(crasher, nullptr, 0);
+	if (count(cache) != cache.chunks_num() - crasher_chunks)
+		fail("Chunks of the crashed process not held");
+	char* held = cache.alloc();
+	if (cache.recover() != crasher_chunks || count(cache) != cache.chunks_num() - 1)
+		fail("Chunks of the crashed process not recovered");
+	if (cache.recover() || cache.recover(::getpid() + 1))
+		fail("Chunks of a live process recovered");
+	cache.free(held);
+
+	int pipes[producers][2];
+	::pid_t pids[producers];
+	for (int id = 0; id < producers; ++id) {
+		if (::pipe(pipes[id]) < 0)
+			fail("pipe");
+		pids[id] = ::fork();
+		if (!pids[id]) {
+			::close(pipes[id][0]);
+			produce(cache.fd(), pipes[id][1], id);
+		}
+		::close(pipes[id][1]);
+	}
+
+	// Producers wait for chunks, so the consumer has to read whichever pipe is ready
+	::pollfd fds[producers];
+	for (int id = 0; id < producers; ++id)
+		fds[id] = ::pollfd{pipes[id][0], POLLIN, 0};
+	for (int left = producers * messages; left > 0; ) {
+		if (::poll(fds, producers, -1) < 0)
+			fail("poll");
+		for (int id = 0; id < producers; ++id) {
+			if (!(fds[id].revents & POLLIN)) {
+				if (fds[id].revents)
+					fds[id].fd = -1;	// Hung up after its last message
+				continue;
+			}
+			::uint64_t off;
+			if (::read(fds[id].fd, &off, sizeof(off)) != sizeof(off))
+				fail("read");
+			char* chunk = cache.chunk(off);
+			cache.adopt(chunk);
+			for (::size_t k = 0; k < chunk_size; ++k)
+				if (chunk[k] != 'a' + id)
+					fail("Difference");
+			cache.free(chunk);
+			--left;
+		}
+	}
+	for (int id = 0; id < producers; ++id) {
+		int status;
+		::waitpid(pids[id], &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			fail("Producer failed");
+	}
+	if (count(cache) != cache.chunks_num())
+		fail("Chunks lost");
+	return 0;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "cache.hpp"
+
+namespace rapidmem {
+
+/* Bounded lock-free LIFO of chunks, an engine of the cache which hands out the
+ * most recently freed chunk first:
+ *
+ *	rapidmem::cache<char, 4, rapidmem::heap_storage<char>, rapidmem::stack> cache{4096, 1024};
+ *
+ * The ring returns the chunk freed longest ago, which has most likely left the
+ * CPU caches and the TLB; the stack returns the chunk which is still hot.
+ *
+ * Chunks are kept in an array of nodes linked into two Treiber stacks, one of
+ * nodes holding chunks and one of empty nodes. Heads carry a counter beside
+ * the node index, so a node popped and pushed back in between does not fool
+ * a CAS (ABA). A thread preempted between taking a node from one stack and
+ * pushing it to the other only holds its node, the others are not delayed.
+ * Both heads are contended by all threads, so the stack scales worse than
+ * the ring with many threads hammering one cache. */
+template <typename T>
+class stack {
+	static constexpr ::uint32_t nil = UINT32_MAX;
+
+	struct node {
+		std::atomic<::uint32_t> next;
+		T* chunk;
+	};
+
+	/* Head of a Treiber stack: index of the top node in the lower half, counter of changes in the upper one */
+	class list {
+		alignas(64) std::atomic<::uint64_t> head_;
+
+	public:
+		list()
+		: head_(nil) {
+		}
+
+		::uint32_t pop(node* nodes) {
+			::uint64_t head = head_.load(std::memory_order_acquire);
+			for (;;) {
+				const ::uint32_t top = head;
+				if (top == nil)
+					return nil;
+				// The node may be popped and reused meanwhile, the CAS fails then
+				const ::uint32_t next = nodes[top].next.load(std::memory_order_relaxed);
+				if (head_.compare_exchange_weak(head, ((head >> 32) + 1) << 32 | next, std::memory_order_acquire, std::memory_order_acquire))
+					return top;
+			}
+		}
+
+		void push(node* nodes, const ::uint32_t i) {
+			::uint64_t head = head_.load(std::memory_order_relaxed);
+			do {
+				nodes[i].next.store(static_cast<::uint32_t>(head), std::memory_order_relaxed);
+			} while (!head_.compare_exchange_weak(head, ((head >> 32) + 1) << 32 | i, std::memory_order_release, std::memory_order_relaxed));
+		}
+	};
+
+	std::unique_ptr<node[]> nodes_;
+	list full_;
+	list empty_;
+	alignas(64) std::atomic<::size_t> size_;
+
+public:
+	explicit stack(const ::size_t size)
+	: nodes_(new node[size])
+	, size_(0) {
+		assert(size > 0 && size < nil);
+		for (::size_t i = size; i-- > 0; ) {
+			nodes_[i].chunk = nullptr;
+			empty_.push(nodes_.get(), i);
+		}
+	}
+
+	/* Approximate number of chunks in the stack */
+	::size_t size() const {
+		return size_.load(std::memory_order_relaxed);
+	}
+
+	/* Returns nullptr if there is no chunk in the stack */
+	T* try_get() {
+		const ::uint32_t i = full_.pop(nodes_.get());
+		if (i == nil)
+			return nullptr;
+		size_.fetch_sub(1, std::memory_order_relaxed);
+		RAPIDMEM_PREEMPT_HOOK();
+		T* chunk = nodes_[i].chunk;
+		empty_.push(nodes_.get(), i);
+		return chunk;
+	}
+
+	/* Returns false if the stack is full */
+	bool try_put(T* chunk) {
+		const ::uint32_t i = empty_.pop(nodes_.get());
+		if (i == nil)
+			return false;
+		RAPIDMEM_PREEMPT_HOOK();
+		nodes_[i].chunk = chunk;
+		// Counted before the chunk can be taken, so the fetch_sub() of try_get() never wraps size_ below zero
+		size_.fetch_add(1, std::memory_order_relaxed);
+		full_.push(nodes_.get(), i);
+		return true;
+	}
+};
+
+} /* namespace rapidmem */
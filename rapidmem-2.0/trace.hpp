@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+
+#include "cache.hpp"
+#include "../c/atrace.h"
+
+namespace rapidmem {
+
+/* Cache that records alloc()/free() calls to the allocation trace (see ../c/atrace.h). */
+template <typename Cache>
+class traced : public Cache {
+public:
+	using Cache::Cache;
+
+	typename Cache::value_type* alloc() {
+		typename Cache::value_type* chunk = Cache::alloc();
+		::atrace_record(ATRACE_CACHE_ALLOC, bytes(), reinterpret_cast<::uintptr_t>(chunk));
+		return chunk;
+	}
+
+	void free(typename Cache::value_type* chunk) {
+		::atrace_record(ATRACE_CACHE_FREE, bytes(), reinterpret_cast<::uintptr_t>(chunk));
+		Cache::free(chunk);
+	}
+
+private:
+	::uint64_t bytes() const {
+		return this->chunk_size() * sizeof(typename Cache::value_type);
+	}
+};
+
+} /* namespace rapidmem */
@@ -0,0 +1,468 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "../rapidmem-2.0/cache.hpp"
+
+extern "C" {
+#include "../c/atrace.h"
+#include "../c/mempool.h"
+}
+
+namespace {
+
+enum class family { cache, mempool };
+
+/* One replayed operation. Allocations are addressed by dense slot numbers assigned in prepare(). */
+struct op {
+	::uint16_t kind;
+	::uint32_t slot;	// Chunk slot for the cache family, state slot for MP_SAVE/MP_RESTORE
+	::uint32_t pool;
+	::uint32_t seq;		// Index of the operation among the operations of its pool
+	::uint64_t size;
+};
+
+struct workload {
+	std::vector<std::vector<op>> threads;
+	::size_t slots = 0;
+	::size_t pools = 0;
+	::size_t ops = 0;
+	::uint64_t max_size = 0;
+};
+
+struct options {
+	::size_t chunk_size = 0;	// 0 = the largest recorded chunk
+	::size_t min_chunks = 1024;
+	unsigned m = 4;
+	::size_t pool_chunk_size = 4096;
+	unsigned upkeep_us = 1000;
+	bool touch = true;
+	std::string backends = "all";
+};
+
+std::vector<atrace_event> load(const char* name) {
+	FILE* f = std::fopen(name, "rb");
+	if (!f) {
+		std::perror(name);
+		std::exit(1);
+	}
+	atrace_header hdr;
+	if (std::fread(&hdr, sizeof(hdr), 1, f) != 1 || std::memcmp(hdr.magic, ATRACE_MAGIC, sizeof(hdr.magic))
+	    || hdr.version != ATRACE_VERSION || hdr.event_size != sizeof(atrace_event)) {
+		std::fprintf(stderr, "%s: not an allocation trace\n", name);
+		std::exit(1);
+	}
+	std::vector<atrace_event> events;
+	atrace_event ev;
+	while (std::fread(&ev, sizeof(ev), 1, f) == 1)
+		events.push_back(ev);
+	std::fclose(f);
+	// Threads flush their buffers independently
+	std::stable_sort(events.begin(), events.end(), [](const atrace_event& a, const atrace_event& b) { return a.ts < b.ts; });
+	return events;
+}
+
+::size_t active_threads(const workload& w) {
+	return std::count_if(w.threads.begin(), w.threads.end(), [](const std::vector<op>& ops) { return !ops.empty(); });
+}
+
+op& emit(workload& w, const atrace_event& ev, ::uint16_t kind) {
+	if (w.threads.size() <= ev.thread)
+		w.threads.resize(ev.thread + 1);
+	w.threads[ev.thread].push_back(op{kind, 0, 0, 0, ev.size});
+	++w.ops;
+	return w.threads[ev.thread].back();
+}
+
+/* Pair frees with allocations and number pools and states densely. Events whose
+ * counterpart happened before the recording started are dropped. */
+workload prepare(const std::vector<atrace_event>& events, family fam, const options& opts) {
+	workload w;
+	std::unordered_map<::uint64_t, ::uint32_t> chunks, pools;
+	std::unordered_map<::uint64_t, std::unordered_map<::uint64_t, ::uint32_t>> states;
+	std::vector<::uint32_t> pool_ops;
+	auto pool_op = [&](const atrace_event& ev, ::uint16_t kind, ::uint32_t pool) -> op& {
+		op& o = emit(w, ev, kind);
+		o.pool = pool;
+		o.seq = pool_ops[pool]++;
+		return o;
+	};
+	auto pool_of = [&](const atrace_event& ev, bool create) -> ::uint32_t {
+		auto it = pools.find(ev.id);
+		if (it != pools.end())
+			return it->second;
+		const ::uint32_t pool = w.pools++;
+		pools[ev.id] = pool;
+		pool_ops.push_back(0);
+		if (create) {
+			// Created before the recording started
+			pool_op(ev, ATRACE_MP_NEW, pool).size = opts.pool_chunk_size;
+		}
+		return pool;
+	};
+	for (const atrace_event& ev : events) {
+		if (fam == family::cache) {
+			if (ev.op == ATRACE_CACHE_ALLOC) {
+				const ::uint32_t slot = w.slots++;
+				chunks[ev.id] = slot;
+				emit(w, ev, ev.op).slot = slot;
+				w.max_size = std::max(w.max_size, ev.size);
+			} else if (ev.op == ATRACE_CACHE_FREE) {
+				auto it = chunks.find(ev.id);
+				if (it == chunks.end())
+					continue;
+				emit(w, ev, ev.op).slot = it->second;
+				chunks.erase(it);
+			}
+			continue;
+		}
+		switch (ev.op) {
+		case ATRACE_MP_NEW: {
+			pools.erase(ev.id);
+			states.erase(ev.id);
+			pool_op(ev, ev.op, pool_of(ev, false));
+			break;
+		}
+		case ATRACE_MP_DELETE:
+			pool_op(ev, ev.op, pool_of(ev, true));
+			pools.erase(ev.id);
+			states.erase(ev.id);
+			break;
+		case ATRACE_MP_ALLOC:
+		case ATRACE_MP_FLUSH:
+			pool_op(ev, ev.op, pool_of(ev, true));
+			break;
+		case ATRACE_MP_SAVE: {
+			const ::uint32_t slot = w.slots++;
+			pool_op(ev, ev.op, pool_of(ev, true)).slot = slot;
+			states[ev.id][ev.size] = slot;
+			break;
+		}
+		case ATRACE_MP_RESTORE: {
+			auto& saved = states[ev.id];
+			auto it = saved.find(ev.size);
+			if (it == saved.end())
+				continue;
+			pool_op(ev, ev.op, pool_of(ev, true)).slot = it->second;
+			break;
+		}
+		}
+	}
+	return w;
+}
+
+void touch(void* p, ::size_t size) {
+	for (::size_t i = 0; i < size; i += 4096)
+		static_cast<volatile char*>(p)[i] = 1;
+}
+
+/* Runs one thread per recorded thread; frees of chunks allocated by another thread wait for the allocation. */
+template <typename Exec>
+std::vector<::uint32_t> run(const workload& w, Exec exec) {
+	std::vector<std::vector<::uint32_t>> latencies(w.threads.size());
+	std::vector<std::thread> threads;
+	for (::size_t t = 0; t < w.threads.size(); ++t) {
+		threads.emplace_back([&, t] {
+			auto& lat = latencies[t];
+			lat.reserve(w.threads[t].size());
+			for (const op& o : w.threads[t]) {
+				const auto beg = std::chrono::steady_clock::now();
+				exec(o);
+				const auto end = std::chrono::steady_clock::now();
+				lat.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count());
+			}
+		});
+	}
+	for (auto& th : threads)
+		th.join();
+	std::vector<::uint32_t> all;
+	for (auto& lat : latencies)
+		all.insert(all.end(), lat.begin(), lat.end());
+	return all;
+}
+
+void* wait_for(std::atomic<void*>& slot) {
+	void* p;
+	while (!(p = slot.load(std::memory_order_acquire)))
+		std::this_thread::yield();
+	return p;
+}
+
+/* A pool can be handed over between threads: its operations run in the recorded
+ * order, each waits for the previous one like frees wait for allocations. The
+ * first operation of a pool creates it, so the pool exists for all later ones. */
+class pool_turns {
+	std::unique_ptr<std::atomic<::uint32_t>[]> next_;
+
+public:
+	explicit pool_turns(const ::size_t pools)
+	: next_(new std::atomic<::uint32_t>[pools]()) {
+	}
+
+	void wait(const op& o) {
+		while (next_[o.pool].load(std::memory_order_acquire) != o.seq)
+			std::this_thread::yield();
+	}
+
+	void done(const op& o) {
+		next_[o.pool].store(o.seq + 1, std::memory_order_release);
+	}
+};
+
+template <unsigned M>
+std::vector<::uint32_t> run_rapidmem(const workload& w, const options& opts) {
+	const ::size_t chunk_size = opts.chunk_size ? opts.chunk_size : w.max_size;
+	rapidmem::cache<char, M> cache{chunk_size, opts.min_chunks};
+	cache.upkeep();
+	std::atomic<bool> upkeep_run{true};
+	std::thread upkeep{[&] {
+		while (upkeep_run.load()) {
+			cache.upkeep();
+			std::this_thread::sleep_for(std::chrono::microseconds(opts.upkeep_us));
+		}
+	}};
+	std::unique_ptr<std::atomic<void*>[]> slots(new std::atomic<void*>[w.slots]());
+	auto lat = run(w, [&](const op& o) {
+		if (o.kind == ATRACE_CACHE_ALLOC) {
+			char* chunk = cache.alloc();
+			if (opts.touch)
+				touch(chunk, o.size);
+			slots[o.slot].store(chunk, std::memory_order_release);
+		} else {
+			cache.free(static_cast<char*>(wait_for(slots[o.slot])));
+		}
+	});
+	upkeep_run.store(false);
+	upkeep.join();
+	return lat;
+}
+
+std::vector<::uint32_t> run_cache_malloc(const workload& w, const options& opts) {
+	std::unique_ptr<std::atomic<void*>[]> slots(new std::atomic<void*>[w.slots]());
+	return run(w, [&](const op& o) {
+		if (o.kind == ATRACE_CACHE_ALLOC) {
+			void* p = std::malloc(o.size);
+			if (opts.touch)
+				touch(p, o.size);
+			slots[o.slot].store(p, std::memory_order_release);
+		} else {
+			std::free(wait_for(slots[o.slot]));
+		}
+	});
+}
+
+std::vector<::uint32_t> run_mempool(const workload& w, const options& opts) {
+	std::vector<mempool*> pools(w.pools);
+	std::unique_ptr<mempool_state[]> states(new mempool_state[w.slots]);
+	pool_turns turns(w.pools);
+	auto lat = run(w, [&](const op& o) {
+		turns.wait(o);
+		mempool*& pool = pools[o.pool];
+		switch (o.kind) {
+		case ATRACE_MP_NEW:
+			pool = mp_new(o.size);
+			break;
+		case ATRACE_MP_DELETE:
+			mp_delete(pool);
+			pool = nullptr;
+			break;
+		case ATRACE_MP_ALLOC: {
+			void* p = mp_alloc(pool, o.size);
+			if (opts.touch)
+				touch(p, o.size);
+			break;
+		}
+		case ATRACE_MP_FLUSH:
+			mp_flush(pool);
+			break;
+		case ATRACE_MP_SAVE:
+			mp_save(pool, &states[o.slot]);
+			break;
+		case ATRACE_MP_RESTORE:
+			mp_restore(pool, &states[o.slot]);
+			break;
+		}
+		turns.done(o);
+	});
+	for (mempool* pool : pools)
+		if (pool)
+			mp_delete(pool);
+	return lat;
+}
+
+/* Mempool operations emulated with one malloc() per allocation */
+std::vector<::uint32_t> run_mempool_malloc(const workload& w, const options& opts) {
+	std::vector<std::vector<void*>> pools(w.pools);
+	std::unique_ptr<::size_t[]> states(new ::size_t[w.slots]);
+	pool_turns turns(w.pools);
+	auto release = [](std::vector<void*>& pool, ::size_t n) {
+		while (pool.size() > n) {
+			std::free(pool.back());
+			pool.pop_back();
+		}
+	};
+	auto lat = run(w, [&](const op& o) {
+		turns.wait(o);
+		std::vector<void*>& pool = pools[o.pool];
+		switch (o.kind) {
+		case ATRACE_MP_ALLOC: {
+			void* p = std::malloc(o.size ? o.size : 1);
+			if (opts.touch)
+				touch(p, o.size);
+			pool.push_back(p);
+			break;
+		}
+		case ATRACE_MP_DELETE:
+		case ATRACE_MP_FLUSH:
+			release(pool, 0);
+			break;
+		case ATRACE_MP_SAVE:
+			states[o.slot] = pool.size();
+			break;
+		case ATRACE_MP_RESTORE:
+			release(pool, std::min(states[o.slot], pool.size()));
+			break;
+		}
+		turns.done(o);
+	});
+	for (auto& pool : pools)
+		release(pool, 0);
+	return lat;
+}
+
+std::vector<::uint32_t> run_backend(const std::string& name, const workload& w, const options& opts) {
+	if (name == "rapidmem") {
+		switch (opts.m) {
+		case 3: return run_rapidmem<3>(w, opts);
+		case 4: return run_rapidmem<4>(w, opts);
+		case 8: return run_rapidmem<8>(w, opts);
+		case 16: return run_rapidmem<16>(w, opts);
+		}
+		std::fprintf(stderr, "Unsupported M=%u (use 3, 4, 8 or 16)\n", opts.m);
+		std::exit(1);
+	} else if (name == "mempool") {
+		return run_mempool(w, opts);
+	} else if (name == "malloc/cache") {
+		return run_cache_malloc(w, opts);
+	} else {
+		return run_mempool_malloc(w, opts);
+	}
+}
+
+long rss_kb() {
+	long pages = 0, resident = 0;
+	FILE* f = std::fopen("/proc/self/statm", "r");
+	if (f) {
+		if (std::fscanf(f, "%ld %ld", &pages, &resident) != 2)
+			resident = 0;
+		std::fclose(f);
+	}
+	return resident * (::sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* Every backend runs in its own process so that the peak RSS is not shared */
+void report(const std::string& name, const workload& w, const options& opts) {
+	std::fflush(stdout);
+	const pid_t pid = ::fork();
+	if (pid < 0) {
+		std::perror("fork");
+		std::exit(1);
+	}
+	if (pid) {
+		int status;
+		::waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			std::fprintf(stderr, "%s: replay failed\n", name.c_str());
+		return;
+	}
+
+	const long base_kb = rss_kb();
+	const auto beg = std::chrono::steady_clock::now();
+	std::vector<::uint32_t> lat = run_backend(name, w, opts);
+	const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - beg).count();
+	struct rusage ru;
+	::getrusage(RUSAGE_SELF, &ru);
+
+	std::sort(lat.begin(), lat.end());
+	auto pct = [&](double p) { return lat.empty() ? 0 : lat[std::min(lat.size() - 1, static_cast<::size_t>(p * lat.size()))]; };
+	std::printf("%-14s %10zu ops %8.3f s %10.3f Mops/s  peak RSS %8ld KB  latency ns p50 %u p90 %u p99 %u p99.9 %u max %u\n",
+		name.c_str(), lat.size(), secs, lat.size() / secs / 1e6, std::max(0L, ru.ru_maxrss - base_kb),
+		pct(0.5), pct(0.9), pct(0.99), pct(0.999), lat.empty() ? 0 : lat.back());
+	std::fflush(stdout);
+	std::_Exit(0);
+}
+
+bool wanted(const options& opts, const char* backend) {
+	return opts.backends == "all" || opts.backends.find(backend) != std::string::npos;
+}
+
+void usage() {
+	std::fprintf(stderr,
+		"Usage: replay [options] trace\n"
+		"  -b list   backends to run: rapidmem, mempool, malloc (default: all)\n"
+		"  -c bytes  rapidmem chunk size (default: the largest recorded chunk)\n"
+		"  -n count  rapidmem minimum number of chunks (default: 1024)\n"
+		"  -m M      rapidmem ring parameter M: 3, 4, 8 or 16 (default: 4)\n"
+		"  -p bytes  chunk size of pools created before the recording started (default: 4096)\n"
+		"  -u usec   rapidmem upkeep interval (default: 1000)\n"
+		"  -T        do not touch allocated memory\n");
+	std::exit(1);
+}
+
+} /* anonymous namespace */
+
+int
+main(int argc, char** argv) {
+	options opts;
+	int c;
+	while ((c = ::getopt(argc, argv, "b:c:n:m:p:u:T")) >= 0) {
+		switch (c) {
+		case 'b': opts.backends = optarg; break;
+		case 'c': opts.chunk_size = std::strtoul(optarg, nullptr, 0); break;
+		case 'n': opts.min_chunks = std::strtoul(optarg, nullptr, 0); break;
+		case 'm': opts.m = std::strtoul(optarg, nullptr, 0); break;
+		case 'p': opts.pool_chunk_size = std::strtoul(optarg, nullptr, 0); break;
+		case 'u': opts.upkeep_us = std::strtoul(optarg, nullptr, 0); break;
+		case 'T': opts.touch = false; break;
+		default: usage();
+		}
+	}
+	if (optind + 1 != argc)
+		usage();
+
+	const std::vector<atrace_event> events = load(argv[optind]);
+
+	const workload cache_ops = prepare(events, family::cache, opts);
+	if (cache_ops.ops) {
+		if (opts.chunk_size && opts.chunk_size < cache_ops.max_size)
+			std::fprintf(stderr, "Warning: chunk size %zu is smaller than recorded chunks of %llu bytes\n",
+				opts.chunk_size, static_cast<unsigned long long>(cache_ops.max_size));
+		std::printf("rapidmem::cache trace: %zu ops in %zu threads\n", cache_ops.ops, active_threads(cache_ops));
+		if (wanted(opts, "rapidmem"))
+			report("rapidmem", cache_ops, opts);
+		if (wanted(opts, "malloc"))
+			report("malloc/cache", cache_ops, opts);
+	}
+
+	const workload mempool_ops = prepare(events, family::mempool, opts);
+	if (mempool_ops.ops) {
+		std::printf("mempool trace: %zu ops in %zu threads, %zu pools\n", mempool_ops.ops, active_threads(mempool_ops), mempool_ops.pools);
+		if (wanted(opts, "mempool"))
+			report("mempool", mempool_ops, opts);
+		if (wanted(opts, "malloc"))
+			report("malloc/mempool", mempool_ops, opts);
+	}
+	return 0;
+}